@@ -1,5 +1,6 @@
 /** Kuroko WASM REPL Shell */
-var krk_call; /* krk_call(string) -> string */
+var krk_call; /* krk_call(string) -> Promise<string> */
+var krkRunning = false; /* whether krk_call is running, possibly between time slices */
 var currentEditor; /* reference to newest Ace instance */
 var consoleEnabled = false; /* whether to print to the browser console */
 var scrollToBottom;
@@ -52,8 +53,21 @@ function runCode(editor) {
   spinner.appendChild(spinnerInner);
   document.getElementById("container").appendChild(spinner);
 
-  window.setTimeout(function() {
-    result = krk_call(value);
+  window.setTimeout(async function() {
+    krkRunning = true;
+    const probe = startLatencyProbe();
+    result = await krk_call(value);
+    Module.lastRun = probe.stop();
+    Module.lastRun.yields = Module.ccall('krk_slice_yields', 'number', [], []);
+    Module.lastRun.stats = JSON.parse(Module.ccall('krk_run_stats', 'string', [], []));
+    if (Module.lastRun.stats.exceeded) {
+      addText('error', 'Stopped: over the ' + Module.lastRun.stats.exceeded + ' limit.');
+    }
+    if (consoleEnabled && Module.lastRun.yields) {
+      console.log('Yielded ' + Module.lastRun.yields + ' times; event loop delay max ' +
+        Module.lastRun.max.toFixed(1) + 'ms, mean ' + Module.lastRun.mean.toFixed(1) + 'ms');
+    }
+    krkRunning = false;
 
     spinner.remove();
 
@@ -70,6 +84,51 @@ function runCode(editor) {
 
 }
 
+/**
+ * Set how long code run from the REPL keeps the page busy before yielding
+ * to it, and how many instructions go between checks of the clock. A time
+ * of 0, the default, runs code to completion without yielding.
+ */
+function setTimeSlice(ms, instructions = 1000) {
+  Module.ccall('krk_set_slice', null, ['number', 'number'], [ms, instructions]);
+}
+
+/**
+ * Limit each run from the REPL to a number of instructions, a time in
+ * milliseconds and growth of the interpreter's heap in bytes. Hitting a
+ * limit raises KeyboardInterrupt in the running code. 0 means no limit.
+ */
+function setQuota(instructions = 0, ms = 0, heap = 0) {
+  Module.ccall('krk_set_quota', null, ['number', 'number', 'number'], [instructions, ms, heap]);
+}
+
+/**
+ * Measures how late timers fire while code runs, which is how long input
+ * would wait for the page to respond.
+ */
+function startLatencyProbe(interval = 16) {
+  const samples = [];
+  let expected = performance.now() + interval;
+  const timer = window.setInterval(function() {
+    const now = performance.now();
+    samples.push(Math.max(0, now - expected));
+    expected = now + interval;
+  }, interval);
+  return {
+    stop: function() {
+      window.clearInterval(timer);
+      /* A run that never yielded held up the timer for its whole length */
+      const late = performance.now() - expected;
+      if (late > 0) samples.push(late);
+      return {
+        samples: samples.length,
+        max: samples.length ? Math.max.apply(null, samples) : 0,
+        mean: samples.length ? samples.reduce(function(a, b) { return a + b; }, 0) / samples.length : 0,
+      };
+    }
+  };
+}
+
 /**
  * Ace command to perform smart enter-key handling.
  *
@@ -152,15 +211,149 @@ function createEditor() {
   return editor;
 }
 
+/**
+ * Printed output. Lines are collected into blocks, one per run of lines in
+ * the same mode with nothing else written in between. A block's element is
+ * added to the page as soon as its first line arrives, so it keeps its
+ * place among editors and other output, but its text is only updated once
+ * per animation frame. Blocks over VIRTUAL_THRESHOLD lines only keep the
+ * rows near the viewport in the DOM. Past outputHistoryCap lines in all,
+ * the oldest output is dropped.
+ */
+var outputHistoryCap = 100000;
+const VIRTUAL_THRESHOLD = 2000;
+const VIRTUAL_OVERSCAN = 50;
+
+var output = {
+  blocks: [],       /* Oldest first */
+  current: null,    /* Block new lines of the same mode go to */
+  dirty: new Set(), /* Blocks to update in the next frame */
+  frame: 0,
+  lines: 0,         /* Lines in all blocks */
+  lineHeight: 0,
+};
+
 function addText(mode, text) {
-  let newOutput = document.createElement("pre");
-  newOutput.className = mode;
-  newOutput.appendChild(document.createTextNode(text));
-  if (!text.length) newOutput.appendChild(document.createElement("wbr"));
-  document.getElementById("container").appendChild(newOutput);
+  const container = document.getElementById("container");
+  let block = output.current;
+  if (!block || block.mode != mode || container.lastChild !== block.element) {
+    block = {
+      mode: mode,
+      element: document.createElement("pre"),
+      text: document.createTextNode(''),
+      lines: [],
+      rendered: 0,    /* Lines in text, when not virtual */
+      virtual: false,
+    };
+    block.element.className = mode;
+    block.element.appendChild(block.text);
+    container.appendChild(block.element);
+    output.blocks.push(block);
+    output.current = block;
+  }
+  block.lines.push(text);
+  output.lines++;
+  output.dirty.add(block);
+  if (!output.frame) output.frame = window.requestAnimationFrame(renderOutput);
+}
+
+function renderOutput() {
+  output.frame = 0;
+  trimOutput();
+  for (const block of output.dirty) {
+    if (!block.virtual && block.lines.length > VIRTUAL_THRESHOLD) {
+      block.virtual = true;
+      block.element.classList.add('virtual');
+      block.rows = document.createElement("div");
+      block.rows.appendChild(block.text);
+      block.element.appendChild(block.rows);
+    }
+    if (block.virtual) {
+      block.element.style.height = (block.lines.length * outputLineHeight()) + 'px';
+      renderRows(block);
+    } else if (block.rendered == 0) {
+      /* A lone empty line still needs its height */
+      block.text.data = block.lines.join('\n') || '\n';
+      block.rendered = block.lines.length;
+    } else if (block.rendered < block.lines.length) {
+      block.text.appendData('\n' + block.lines.slice(block.rendered).join('\n'));
+      block.rendered = block.lines.length;
+    }
+  }
+  output.dirty.clear();
+}
+
+/* Fill a virtual block's rows for the part of it near the viewport */
+function renderRows(block) {
+  const height = outputLineHeight();
+  const top = block.element.getBoundingClientRect().top;
+  const first = Math.max(0, Math.floor(-top / height) - VIRTUAL_OVERSCAN);
+  const last = Math.min(block.lines.length, Math.ceil((window.innerHeight - top) / height) + VIRTUAL_OVERSCAN);
+  if (first >= last) {
+    block.text.data = '';
+    block.shown = null;
+    return;
+  }
+  if (block.shown && block.shown[0] == first && block.shown[1] == last && block.shown[2] == block.lines.length) return;
+  block.shown = [first, last, block.lines.length];
+  block.rows.style.top = (first * height) + 'px';
+  block.text.data = block.lines.slice(first, last).join('\n');
 }
 
+function outputLineHeight() {
+  if (!output.lineHeight) {
+    const probe = document.createElement("pre");
+    probe.className = 'printed';
+    probe.textContent = 'X';
+    document.getElementById("container").appendChild(probe);
+    output.lineHeight = probe.getBoundingClientRect().height || 20;
+    probe.remove();
+  }
+  return output.lineHeight;
+}
+
+/* Drop the oldest lines once there are more than outputHistoryCap */
+function trimOutput() {
+  while (output.lines > outputHistoryCap && output.blocks.length) {
+    const block = output.blocks[0];
+    const excess = output.lines - outputHistoryCap;
+    if (excess >= block.lines.length) {
+      output.lines -= block.lines.length;
+      block.element.remove();
+      output.blocks.shift();
+      output.dirty.delete(block);
+      if (output.current === block) output.current = null;
+    } else {
+      block.lines.splice(0, excess);
+      output.lines -= excess;
+      block.rendered = 0;
+      block.shown = null;
+      output.dirty.add(block);
+    }
+  }
+}
+
+window.addEventListener('scroll', function() {
+  for (const block of output.blocks) {
+    if (block.virtual) output.dirty.add(block);
+  }
+  if (!output.frame) output.frame = window.requestAnimationFrame(renderOutput);
+}, { passive: true });
+
+window.addEventListener('resize', function() {
+  output.lineHeight = 0;
+  for (const block of output.blocks) {
+    if (block.virtual) {
+      block.shown = null;
+      output.dirty.add(block);
+    }
+  }
+  if (!output.frame) output.frame = window.requestAnimationFrame(renderOutput);
+});
+
 function insertCode(code) {
+  /* Code is still running between time slices, and there is no editor yet */
+  if (krkRunning) return false;
   currentEditor.setValue(code,1);
   window.setTimeout(function() { runCode(currentEditor); }, 100);
   return false;
@@ -176,53 +369,85 @@ function insertThis(e) {
   return false;
 }
 
-var Module = {
-  preRun: [function() {
-    const fs = { usr: { local: { lib: { kuroko: {
-      syntax: {
-        '__init__.krk': 1,
-        'highlighter.krk': 1,
-      },
-      foo: {
-        bar: {
-          '__init__.krk': 1,
-          'baz.krk': 1,
-        },
-        '__init__.krk': 1,
-      },
-      'help.krk': 1,
-      'collections.krk': 1,
-      'json.krk': 1,
-      'string.krk': 1,
-      'web.krk': 1,
-      'dummy.krk': 1,
-    }}}}};
-
-    function processFiles(node, parent) {
-      for (const [key, value] of Object.entries(node)) {
-        if (value === 1) {
-          FS.createPreloadedFile(parent, key, '/res/' + key, 1, 0);
-        } else {
-          const path = parent + '/' + key;
-          FS.mkdir(path);
-          processFiles(value, path);
-        }
+/**
+ * Compiled wasm modules by URL, for the page and for the workers it starts.
+ * Compilation streams from the network. Where the browser can store
+ * modules in IndexedDB, they are kept there along with the response's
+ * validator, so a new build is compiled again and an unchanged one isn't.
+ */
+var wasmModules = {};
+
+function wasmCache(mode, action) {
+  return new Promise(function (resolve, reject) {
+    const open = indexedDB.open('kuroko-wasm', 1);
+    open.onupgradeneeded = function () { open.result.createObjectStore('modules'); };
+    open.onerror = function () { reject(open.error); };
+    open.onsuccess = function () {
+      const tx = open.result.transaction('modules', mode);
+      const request = action(tx.objectStore('modules'));
+      tx.oncomplete = function () { resolve(request.result); };
+      tx.onerror = tx.onabort = function () { reject(tx.error); };
+    };
+  });
+}
+
+function compileWasm(url) {
+  if (!wasmModules[url]) wasmModules[url] = (async function () {
+    const response = await fetch(url, { cache: 'no-cache' });
+    if (!response.ok) throw new Error('Failed to load ' + url);
+    const version = response.headers.get('ETag') || response.headers.get('Last-Modified');
+    if (version) {
+      const cached = await wasmCache('readonly', function (store) { return store.get(url); }).catch(function () {});
+      if (cached && cached.version === version) {
+        if (response.body) response.body.cancel();
+        return cached.module;
       }
     }
+    let module;
+    try {
+      module = await WebAssembly.compileStreaming(response);
+    } catch (err) {
+      /* Usually a server that doesn't send application/wasm */
+      module = await WebAssembly.compile(await (await fetch(url)).arrayBuffer());
+    }
+    if (version) {
+      wasmCache('readwrite', function (store) { return store.put({ version: version, module: module }, url); }).catch(function () {});
+    }
+    return module;
+  })();
+  return wasmModules[url];
+}
 
-    processFiles(fs, '/');
-  }],
-  postRun: [function() {
-    /* Bind krk_call */
-    krk_call = Module.cwrap('krk_call', 'string', ['string']);
+var Module = {
+  instantiateWasm: function(imports, receiveInstance) {
+    compileWasm('index.wasm').then(function (module) {
+      return WebAssembly.instantiate(module, imports).then(function (instance) {
+        receiveInstance(instance, module);
+      });
+    }).catch(function (err) {
+      console.error('Failed to load index.wasm', err);
+    });
+    return {};
+  },
+  /* The library tree comes from res/lib.data, see the Makefile */
+  locateFile: function(path, prefix) {
+    return (path.startsWith('lib.') ? '/res/' : prefix) + path;
+  },
+  postRun: [async function() {
+    /* Bind krk_call; it returns a promise, as it may yield between time slices */
+    krk_call = Module.cwrap('krk_call', 'string', ['string'], { async: true });
 
     /* Print some startup text. */
-    krk_call("if True:\n import kuroko\n print('Kuroko',kuroko.version,kuroko.builddate,'(wasm)')\n kuroko.set_clean_output(True)\n");
-    krk_call("print('Type `tutorial()` for an interactive guide, `license` for copyright information.')\n");
-    krk_call("def tutorial(n=0):\n from web import tutorial as actual\n actual(n)\n");
+    await krk_call("if True:\n import kuroko\n print('Kuroko',kuroko.version,kuroko.builddate,'(wasm)')\n kuroko.set_clean_output(True)\n");
+    await krk_call("print('Type `tutorial()` for an interactive guide, `license` for copyright information.')\n");
+    await krk_call("def tutorial(n=0):\n from web import tutorial as actual\n actual(n)\n");
 
     /* Start the first repl line editor */
     currentEditor = createEditor();
+
+    /* Time from navigation to the first prompt, for comparing startup changes */
+    Module.timeToPrompt = performance.now();
+    if (consoleEnabled) console.log('First prompt after ' + Module.timeToPrompt.toFixed(1) + 'ms');
     const urlParams = new URLSearchParams(window.location.search);
     const codeParam = urlParams.get('c');
     if (codeParam) {
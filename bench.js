@@ -0,0 +1,330 @@
+/**
+ * Benchmarks for the REPL page. index.html doesn't load this; to use it,
+ * load it from the browser console once the prompt is up:
+ *
+ *   document.head.appendChild(Object.assign(document.createElement('script'), {src: 'bench.js'}))
+ *
+ * then call the benchmark you want. Each one logs its figures and
+ * returns them.
+ */
+
+/**
+ * The Map-based handle table Hiwire used before its slot table, kept so
+ * benchmarkHiwire has something to compare against.
+ */
+function MapHandleTable() {
+  const objects = new Map();
+  const obj_to_key = new Map();
+  const counter = new Uint32Array([1]);
+  this.new_value = function(jsval) {
+    let idval = obj_to_key.get(jsval);
+    if (idval !== undefined) {
+      objects.get(idval)[1]++;
+      return idval;
+    }
+    while (objects.has(counter[0])) {
+      counter[0] += 2;
+    }
+    idval = counter[0];
+    objects.set(idval, [ jsval, 1 ]);
+    obj_to_key.set(jsval, idval);
+    counter[0] += 2;
+    return idval;
+  };
+  this.get_value = function(idval) {
+    if (!objects.has(idval)) throw new Error(`idval not found ${idval}`);
+    return objects.get(idval)[0];
+  };
+  this.decref = function(idval) {
+    if ((idval & 1) === 0) return;
+    let pair = objects.get(idval);
+    if (--pair[1] === 0) {
+      objects.delete(idval);
+      obj_to_key.delete(pair[0]);
+    }
+  };
+}
+
+/**
+ * Allocate, read and release `count` handles, `live` at a time, through
+ * Hiwire and through the old Map-based table. Reports handles per second
+ * for each.
+ */
+function benchmarkHiwire(count = 1000000, live = 1000) {
+  const values = [];
+  for (let i = 0; i < live; ++i) values.push({ index: i });
+  const ids = new Array(live);
+  function run(table) {
+    const start = performance.now();
+    for (let done = 0; done < count; done += live) {
+      for (let i = 0; i < live; ++i) ids[i] = table.new_value(values[i]);
+      for (let i = 0; i < live; ++i) table.get_value(ids[i]);
+      for (let i = 0; i < live; ++i) table.decref(ids[i]);
+    }
+    return count / ((performance.now() - start) / 1000);
+  }
+  const results = { map: run(new MapHandleTable()), slots: run(Hiwire) };
+  console.log('Map table: ' + Math.round(results.map) + ' handles/s, slot table: ' +
+    Math.round(results.slots) + ' handles/s (' + (results.slots / results.map).toFixed(2) + 'x)');
+  return results;
+}
+
+/**
+ * Print `count` lines through addText and report how many lines per second
+ * made it onto the page, counting until the frame that renders them.
+ */
+async function benchmarkOutput(count = 200000) {
+  const start = performance.now();
+  for (let i = 0; i < count; ++i) {
+    addText('printed', 'Line ' + i + ' of the output benchmark');
+  }
+  await new Promise(function(resolve) { window.requestAnimationFrame(function() { window.setTimeout(resolve, 0); }); });
+  const elapsed = performance.now() - start;
+  const rate = count / (elapsed / 1000);
+  console.log(count + ' lines in ' + elapsed.toFixed(1) + 'ms, ' + Math.round(rate) + ' lines/s');
+  return rate;
+}
+
+/**
+ * Run `code` through krk_call `runs` times, after one untimed run to warm
+ * up, and return the fastest run in milliseconds along with how many
+ * Hiwire handles it allocated.
+ */
+async function timeKuroko(code, runs = 5) {
+  if (krkRunning) throw new Error('code is already running');
+  krkRunning = true;
+  try {
+    await krk_call(code);
+    let best = { ms: Infinity, handles: 0 };
+    for (let i = 0; i < runs; ++i) {
+      const handles = Hiwire.allocated;
+      const start = performance.now();
+      await krk_call(code);
+      const ms = performance.now() - start;
+      if (ms < best.ms) best = { ms: ms, handles: Hiwire.allocated - handles };
+    }
+    return best;
+  } finally {
+    krkRunning = false;
+  }
+}
+
+/**
+ * Call document.createElement `count` times from Kuroko, as res/web.krk
+ * and other DOM-heavy code does, and report the time and the Hiwire
+ * handles each call takes. Fetching the method used to cost a JSObject
+ * and a handle of its own on every call.
+ */
+async function benchmarkCreateElement(count = 100000, runs = 5) {
+  const result = await timeKuroko(
+    'from js import document\n' +
+    'for i in range(' + count + '):\n' +
+    '    document.createElement("div")\n', runs);
+  const perCall = { us: result.ms * 1000 / count, handles: result.handles / count };
+  console.log(count + ' createElement calls in ' + result.ms.toFixed(1) + 'ms: ' +
+    perCall.us.toFixed(2) + 'us and ' + perCall.handles.toFixed(2) + ' handles per call');
+  return perCall;
+}
+
+/**
+ * Call a Kuroko function from JS `count` times, the way event handlers
+ * are called, and report calls per second. `frame` goes through the
+ * wrapper's shared call frame; `boxed` goes through krk_call_args with
+ * the arguments in a Hiwire handle, which is how every call used to go.
+ */
+async function benchmarkCallbacks(count = 100000) {
+  if (krkRunning) throw new Error('code is already running');
+  krkRunning = true;
+  let results;
+  try {
+    await krk_call('import js\njs.window.benchmarkCallback = lambda x, y: x + y\n');
+    const callback = window.benchmarkCallback;
+    function boxed() {
+      const argsid = Hiwire.new_value(arguments);
+      const resid = Module._krk_call_args(callback.__id__, argsid);
+      Hiwire.decref(argsid);
+      return Hiwire.pop_value(resid);
+    }
+    function run(fn) {
+      let total = 0;
+      const start = performance.now();
+      for (let i = 0; i < count; ++i) total += fn(i, 1);
+      return count / ((performance.now() - start) / 1000);
+    }
+    run(callback);
+    run(boxed);
+    results = { frame: run(callback), boxed: run(boxed) };
+  } finally {
+    delete window.benchmarkCallback;
+    krkRunning = false;
+  }
+  console.log('Boxed: ' + Math.round(results.boxed) + ' calls/s, call frame: ' +
+    Math.round(results.frame) + ' calls/s (' + (results.frame / results.boxed).toFixed(2) + 'x)');
+  return results;
+}
+
+/* krk_call for a benchmark's setup, holding krkRunning like a REPL run */
+async function benchmarkCall(code) {
+  if (krkRunning) throw new Error('code is already running');
+  krkRunning = true;
+  try {
+    return await krk_call(code);
+  } finally {
+    krkRunning = false;
+  }
+}
+
+/**
+ * Run the script at `path` in a pooled worker from `url`, once to warm the
+ * worker up and once more timed. Resolves with the milliseconds from
+ * starting the timed job to its result, which arrives after its output.
+ */
+async function timeWorker(path, url = 'kuroko.js') {
+  if (krkRunning) throw new Error('code is already running');
+  krkRunning = true;
+  try {
+    await krk_call('import js\njs.worker_pool(' + JSON.stringify(url) + ', 1)\n');
+    let ms = 0;
+    for (let run = 0; run < 2; ++run) {
+      ms = await new Promise(function(resolve) {
+        const start = performance.now();
+        window.benchmarkWorkerDone = function() { resolve(performance.now() - start); };
+        krk_call('js.run_worker(' + JSON.stringify(url) + ', ' + JSON.stringify(path) + ', js.window.benchmarkWorkerDone, "")\n');
+      });
+    }
+    return ms;
+  } finally {
+    delete window.benchmarkWorkerDone;
+    krkRunning = false;
+  }
+}
+
+/**
+ * Have a worker print 100000 lines (res/bench_output.krk) and report how
+ * many lines per second reach the page's output.
+ */
+async function benchmarkWorkerOutput(url = 'kuroko.js') {
+  const count = 100000;
+  const ms = await timeWorker('/usr/local/lib/kuroko/bench/output.krk', url);
+  const rate = count / (ms / 1000);
+  console.log(count + ' worker lines in ' + ms.toFixed(1) + 'ms, ' + Math.round(rate) + ' lines/s');
+  return rate;
+}
+
+/**
+ * Time a CPU-bound script (res/bench_loop.krk) in the Asyncify worker and,
+ * where the browser supports JSPI, in the JSPI worker. `make sizes` gives
+ * the sizes of their .wasm files. The worker pool is restored afterwards.
+ */
+async function benchmarkWorkerVariants() {
+  const path = '/usr/local/lib/kuroko/bench/loop.krk';
+  const results = {};
+  await benchmarkCall('import js\n_benchmarkPool = js.worker_pool_stats()\n');
+  try {
+    Module.workerJspi = false;
+    try {
+      results.asyncify = await timeWorker(path, 'kuroko.js');
+    } finally {
+      delete Module.workerJspi;
+    }
+    if (typeof WebAssembly.Suspending === 'function') {
+      results.jspi = await timeWorker(path, 'kuroko-jspi.js');
+    }
+  } finally {
+    /* Put the page's pool back as it was */
+    await benchmarkCall("js.worker_pool(_benchmarkPool['url'], _benchmarkPool['size'])\ndel _benchmarkPool\n");
+  }
+  console.log('Asyncify worker: ' + results.asyncify.toFixed(1) + 'ms' + (results.jspi === undefined ? '' :
+    ', JSPI worker: ' + results.jspi.toFixed(1) + 'ms (' + (results.asyncify / results.jspi).toFixed(2) + 'x)'));
+  return results;
+}
+
+/**
+ * Time a CPU-bound loop from the REPL with time slicing off and with
+ * `ms` slices, and report how much slower single-stepping makes it.
+ * Leaves slicing off afterwards.
+ */
+async function benchmarkTimeSlicing(ms = 10, runs = 5) {
+  const code = 'let total = 0\nfor i in range(1000000):\n    total += i\n';
+  const results = {};
+  try {
+    setTimeSlice(0);
+    results.off = (await timeKuroko(code, runs)).ms;
+    setTimeSlice(ms);
+    results.on = (await timeKuroko(code, runs)).ms;
+  } finally {
+    setTimeSlice(0);
+  }
+  console.log('Slicing off: ' + results.off.toFixed(1) + 'ms, ' + ms + 'ms slices: ' +
+    results.on.toFixed(1) + 'ms (' + (results.on / results.off).toFixed(2) + 'x)');
+  return results;
+}
+
+/**
+ * Check that time slicing works with the page build as it was linked,
+ * most of all with ASYNCIFY_SCOPED=1 (see the Makefile): run a loop in
+ * 1ms slices that calls out to JS and back into Kuroko on every pass,
+ * and check that it yielded and got the right answer. A bad Asyncify
+ * setup traps with "unreachable" instead.
+ */
+async function checkTimeSlicing(count = 200000) {
+  window.benchmarkRelay = function(f, x) { return f(x); };
+  const code =
+    'import js\n' +
+    'let total = 0\n' +
+    'let step = lambda x: x + 1\n' +
+    'for i in range(' + count + '):\n' +
+    '    total = js.window.benchmarkRelay(step, total)\n' +
+    'total\n';
+  let result;
+  try {
+    setTimeSlice(1);
+    result = await benchmarkCall(code);
+  } finally {
+    setTimeSlice(0);
+    delete window.benchmarkRelay;
+  }
+  const yields = Module.ccall('krk_slice_yields', 'number', [], []);
+  const ok = result === String(count) && yields > 0;
+  console.log((ok ? 'Time slicing works: ' : 'Time slicing FAILED: ') +
+    'got ' + result + ', expected ' + count + ', yielded ' + yields + ' times');
+  return { ok: ok, result: result, yields: yields };
+}
+
+/**
+ * Load the page `runs` times in a hidden frame and report the time from
+ * navigation to the first prompt (Module.timeToPrompt). The first load
+ * may have to fetch and compile what later ones find in the cache, so it
+ * is reported on its own, with the median of the rest.
+ */
+async function benchmarkStartup(runs = 5) {
+  const times = [];
+  for (let i = 0; i < runs; ++i) {
+    const frame = document.createElement('iframe');
+    frame.style.display = 'none';
+    frame.src = window.location.pathname;
+    document.body.appendChild(frame);
+    try {
+      times.push(await new Promise(function(resolve, reject) {
+        const started = performance.now();
+        const poll = window.setInterval(function() {
+          const module = frame.contentWindow && frame.contentWindow.Module;
+          if (module && module.timeToPrompt) {
+            window.clearInterval(poll);
+            resolve(module.timeToPrompt);
+          } else if (performance.now() - started > 60000) {
+            window.clearInterval(poll);
+            reject(new Error('no prompt after 60s'));
+          }
+        }, 10);
+      }));
+    } finally {
+      frame.remove();
+    }
+  }
+  const warm = times.slice(1).sort(function(a, b) { return a - b; });
+  const results = { first: times[0], median: warm.length ? warm[warm.length >> 1] : times[0] };
+  console.log('First prompt after ' + results.first.toFixed(1) + 'ms on the first load, ' +
+    results.median.toFixed(1) + 'ms median after that');
+  return results;
+}
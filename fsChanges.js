@@ -0,0 +1,37 @@
+/**
+ * Applying file changes sent between workers and the page (see
+ * _fsSendChanges in workerWrapper.js). Both the page and the worker build
+ * include this with --pre-js: the page applies the changes a worker
+ * reports in worker_setup_fs in js.c, and workers apply the ones the page
+ * passes on to them in _fsApplyChanges.
+ */
+function _fsRemove(path) {
+  if (FS.isDir(FS.stat(path).mode)) {
+    FS.readdir(path).forEach(function (name) {
+      if (name !== '.' && name !== '..') _fsRemove(path + '/' + name);
+    });
+    FS.rmdir(path);
+  } else {
+    FS.unlink(path);
+  }
+}
+
+function _fsApply(changes) {
+  changes.forEach(function (change) {
+    try {
+      var existing = null;
+      try { existing = FS.stat(change.path); } catch (err) {}
+      if (existing && (change.deleted || FS.isDir(existing.mode) !== !!change.dir)) _fsRemove(change.path);
+      if (change.deleted) return;
+      if (change.dir) {
+        FS.mkdirTree(change.path);
+        return;
+      }
+      FS.mkdirTree(PATH.dirname(change.path));
+      FS.writeFile(change.path, new Uint8Array(change.contents));
+      FS.utime(change.path, change.timestamp, change.timestamp);
+    } catch (err) {
+      console.log(err);
+    }
+  });
+}
@@ -8,9 +8,12 @@
 #include <emscripten.h>
 #include <unistd.h>
 #include <kuroko/util.h>
+#include <kuroko/memory.h>
 
 static KrkInstance * jsModule;
 static KrkClass * JSObject;
+static KrkClass * JSIterator;
+static KrkClass * JSBatch;
 
 struct _JsRefStruct {};
 typedef struct _JsRefStruct* JsRef;
@@ -19,6 +22,9 @@ struct JSObject {
 	KrkInstance inst;
 	JsRef js;
 	JsRef this;
+	KrkString * name;           /* For methods: looked up on receiver when called */
+	struct JSObject * receiver; /* For methods: the object they were fetched from */
+	struct JSObject * method;   /* Last method fetched from this object, for reuse */
 };
 
 EMSCRIPTEN_KEEPALIVE const JsRef Js_undefined = ((JsRef)(2));
@@ -27,58 +33,207 @@ EMSCRIPTEN_KEEPALIVE const JsRef Js_false = ((JsRef)(6));
 EMSCRIPTEN_KEEPALIVE const JsRef Js_null = ((JsRef)(8));
 EMSCRIPTEN_KEEPALIVE const JsRef Js_novalue = ((JsRef)(10));
 
+/**
+ * Numbers cross the boundary without a handle. The value is written to
+ * a slot in a small ring in linear memory and the reference encodes
+ * which slot it is in, and whether it was a safe integer. Immediate refs
+ * are even so incref/decref ignore them, and a ref stays valid until the
+ * ring wraps around, so they must be consumed right away.
+ */
+#define JS_IMMEDIATE_SLOTS 16
+#define JS_IMMEDIATE       0x40000000
+#define JS_IMMEDIATE_INT   0x2
+#define JS_IS_IMMEDIATE(ref)    ((uintptr_t)(ref) & JS_IMMEDIATE)
+#define JS_IMMEDIATE_SLOT(ref)  (((uintptr_t)(ref) >> 2) & (JS_IMMEDIATE_SLOTS - 1))
+#define JS_IMMEDIATE_ISINT(ref) ((uintptr_t)(ref) & JS_IMMEDIATE_INT)
+
+/**
+ * Argument vectors for calls into JS. Each entry is 16 bytes so the
+ * payload is 8-byte aligned; Hiwire.decode_args reads them back and
+ * releases any owned refs, so a whole call is one crossing.
+ *
+ * The same layout is used by js_callframe for calls from JS into
+ * Kuroko, where strings are malloc'd by JS and owned by the receiver,
+ * and `length` is set for numbers that are safe integers.
+ */
+enum JsArgType {
+	JS_ARG_REF = 0,      /* owned ref, released after decoding */
+	JS_ARG_BORROWED = 1, /* borrowed ref, e.g. from a JSObject */
+	JS_ARG_NUMBER = 2,   /* as.number */
+	JS_ARG_STRING = 3,   /* as.chars, length bytes of UTF-8 */
+	JS_ARG_CACHED = 4,   /* as.id into the string cache */
+};
+
+struct JsArg {
+	uint32_t type;
+	uint32_t length;
+	union {
+		double number;
+		JsRef ref;
+		const char * chars;
+		int id;
+	} as;
+};
+
+#define JS_ARGS_ON_STACK 8
+#define JS_CALLFRAME_SIZE 16
+
+EMSCRIPTEN_KEEPALIVE struct JsArg js_callframe[JS_CALLFRAME_SIZE];
+
+/**
+ * Iterating a JSObject fetches elements in batches through a frame on
+ * the C stack, so a scan over N elements costs about N / JS_ITER_BATCH
+ * crossings. The frame is per call, as a JS iterator's next() may call
+ * back into Kuroko and iterate something else while a fill is underway.
+ */
+#define JS_ITER_BATCH 256
+
+struct JSIterator {
+	KrkInstance inst;
+	JsRef iter;
+	int index;
+	int count;
+	int done;
+	KrkValue buffer[JS_ITER_BATCH];
+};
+
+/**
+ * Packed value graphs, for moving a whole structure across the boundary
+ * in one crossing. Each value is a tag byte followed by its payload;
+ * counts and lengths are uint32 and numbers are float64, both
+ * little-endian and unaligned.
+ */
+enum JsPackTag {
+	JS_PACK_UNDEFINED = 0,
+	JS_PACK_NULL = 1,
+	JS_PACK_TRUE = 2,
+	JS_PACK_FALSE = 3,
+	JS_PACK_NUMBER = 4,        /* float64 */
+	JS_PACK_INTEGER = 5,       /* float64, a safe integer */
+	JS_PACK_STRING = 6,        /* length, UTF-8 bytes */
+	JS_PACK_REF = 7,           /* owned ref */
+	JS_PACK_ARRAY = 8,         /* count, values */
+	JS_PACK_OBJECT = 9,        /* count, key and value pairs */
+	JS_PACK_SET = 10,          /* count, values */
+	JS_PACK_BYTES = 11,        /* length, bytes; a Uint8Array */
+	JS_PACK_INT32ARRAY = 12,   /* count, int32 values */
+	JS_PACK_FLOAT64ARRAY = 13, /* count, float64 values */
+};
+
+#define JS_PACK_MAX_DEPTH 256
+
+/**
+ * Recorded DOM operations for js.batch(). Node operands are a kind byte
+ * (0 for a node created by the batch, by index; 1 for a borrowed ref)
+ * and a uint32; strings and values use the packed format above.
+ */
+enum JsBatchOp {
+	JS_BATCH_CREATE = 0, /* tag */
+	JS_BATCH_TEXT = 1,   /* node, text */
+	JS_BATCH_HTML = 2,   /* node, html */
+	JS_BATCH_SET = 3,    /* node, name, value */
+	JS_BATCH_ATTR = 4,   /* node, name, value */
+	JS_BATCH_APPEND = 5, /* parent, child */
+};
+
+EMSCRIPTEN_KEEPALIVE double js_immediates[JS_IMMEDIATE_SLOTS];
+EMSCRIPTEN_KEEPALIVE uint32_t js_immediate_next = 0;
+
+static JsRef hiwire_number(double val, int isInt) {
+	uint32_t slot = js_immediate_next++ & (JS_IMMEDIATE_SLOTS - 1);
+	js_immediates[slot] = val;
+	return (JsRef)(uintptr_t)(JS_IMMEDIATE | (slot << 2) | (isInt ? JS_IMMEDIATE_INT : 0));
+}
+
 EM_JS(int, js_krk_init, (), {
+	/**
+	 * Handles are slots in a dense table. Dynamic handles are odd:
+	 * (slot << 1) | 1, with the live value in `values` and its refcount
+	 * in `refcounts`. Released slots go on a free stack and are reused
+	 * before the table grows. Permanent handles are even and index
+	 * into `permanents` by (id >> 1); they are never refcounted.
+	 * Numbers never get a slot; see JS_IMMEDIATE.
+	 */
 	let _hiwire = {
-		objects: new Map(),
-		obj_to_key: new Map(),
-		counter: new Uint32Array([1])
+		values: [],
+		refcounts: new Uint32Array(1024),
+		free: new Uint32Array(1024),
+		free_count: 0,
+		next_slot: 0,
+		permanents: [],
 	};
 
+	function grow() {
+		let size = _hiwire.refcounts.length * 2;
+		let refcounts = new Uint32Array(size);
+		refcounts.set(_hiwire.refcounts);
+		_hiwire.refcounts = refcounts;
+		let free = new Uint32Array(size);
+		free.set(_hiwire.free);
+		_hiwire.free = free;
+	}
+
 	window.Hiwire = {};
 
 	Hiwire.UNDEFINED = HEAPU8[_Js_undefined];
-	_hiwire.objects.set(Hiwire.UNDEFINED, [ undefined, -1 ]);
-	_hiwire.obj_to_key.set(undefined, Hiwire.UNDEFINED);
+	_hiwire.permanents[Hiwire.UNDEFINED >> 1] = undefined;
 
 	Hiwire.TRUE = HEAPU8[_Js_true];
-	_hiwire.objects.set(Hiwire.TRUE, [ true, -1 ]);
-	_hiwire.obj_to_key.set(true, Hiwire.TRUE);
+	_hiwire.permanents[Hiwire.TRUE >> 1] = true;
 
 	Hiwire.FALSE = HEAPU8[_Js_false];
-	_hiwire.objects.set(Hiwire.FALSE, [ false, -1 ]);
-	_hiwire.obj_to_key.set(false, Hiwire.FALSE);
+	_hiwire.permanents[Hiwire.FALSE >> 1] = false;
 
 	Hiwire.JSNULL = HEAPU8[_Js_null];
-	_hiwire.objects.set(Hiwire.JSNULL, [ null, -1 ]);
-	_hiwire.obj_to_key.set(null, Hiwire.JSNULL);
+	_hiwire.permanents[Hiwire.JSNULL >> 1] = null;
+
+	Hiwire.NOVALUE = HEAPU8[_Js_novalue];
+
+	/* Dynamic handles handed out so far, for benchmarks */
+	Hiwire.allocated = 0;
 
 	let next_permanent = HEAPU8[_Js_novalue] + 2;
 
+	/* Keep in sync with JS_IMMEDIATE_* */
+	const IMMEDIATE_SLOTS = 16;
+	const IMMEDIATE = 0x40000000;
+	const IMMEDIATE_INT = 0x2;
+
 	Hiwire.new_value = function(jsval) {
-		let idval = _hiwire.obj_to_key.get(jsval);
-		if (idval !== undefined) {
-			_hiwire.objects.get(idval)[1]++;
-			return idval;
-		}
-		while (_hiwire.objects.has(_hiwire.counter[0])) {
-			_hiwire.counter[0] += 2;
-		}
-		idval = _hiwire.counter[0];
-		_hiwire.objects.set(idval, [ jsval, 1 ]);
-		_hiwire.obj_to_key.set(jsval, idval);
-		_hiwire.counter[0] += 2;
-		return idval;
+		/* Constants always map to their permanent ids. */
+		if (jsval === undefined) return Hiwire.UNDEFINED;
+		if (jsval === null) return Hiwire.JSNULL;
+		if (jsval === true) return Hiwire.TRUE;
+		if (jsval === false) return Hiwire.FALSE;
+
+		if (typeof jsval === 'number') {
+			let slot = HEAPU32[_js_immediate_next >> 2]++ & (IMMEDIATE_SLOTS - 1);
+			HEAPF64[(_js_immediates >> 3) + slot] = jsval;
+			return IMMEDIATE | (slot << 2) | (Number.isSafeInteger(jsval) ? IMMEDIATE_INT : 0);
+		}
+
+		let slot;
+		if (_hiwire.free_count) {
+			slot = _hiwire.free[--_hiwire.free_count];
+		} else {
+			slot = _hiwire.next_slot++;
+			if (slot === _hiwire.refcounts.length) grow();
+		}
+		_hiwire.values[slot] = jsval;
+		_hiwire.refcounts[slot] = 1;
+		Hiwire.allocated++;
+		return (slot << 1) | 1;
 	};
 
 	Hiwire.intern_object = function(obj) {
 		let id = next_permanent;
 		next_permanent += 2;
-		_hiwire.objects.set(id, [ obj, -1 ]);
+		_hiwire.permanents[id >> 1] = obj;
 		return id;
 	};
 
 	Hiwire.num_keys = function() {
-		return Array.from(_hiwire.objects.keys()).filter((x) => x % 2).length;
+		return _hiwire.next_slot - _hiwire.free_count;
 	};
 
 	Hiwire.get_value = function(idval) {
@@ -87,27 +242,49 @@ EM_JS(int, js_krk_init, (), {
 			throw new Error("idval is unset in get_value");
 		}
 
-		if (!_hiwire.objects.has(idval)) {
+		if (idval & IMMEDIATE) {
+			return HEAPF64[(_js_immediates >> 3) + ((idval >> 2) & (IMMEDIATE_SLOTS - 1))];
+		}
+
+		if (idval & 1) {
+			let slot = idval >>> 1;
+			if (slot >= _hiwire.next_slot || _hiwire.refcounts[slot] === 0) {
+				console.error(`idval not found ${idval}`);
+				throw new Error(`idval not found ${idval}`);
+			}
+			return _hiwire.values[slot];
+		}
+
+		if (!((idval >>> 1) in _hiwire.permanents)) {
 			console.error(`idval not found ${idval}`);
 			throw new Error(`idval not found ${idval}`);
 		}
 
-		return _hiwire.objects.get(idval)[0];
+		return _hiwire.permanents[idval >>> 1];
 	};
 
+	/* A released slot has a refcount of 0; touching it again is a bug. */
+	function live_slot(idval) {
+		let slot = idval >>> 1;
+		if (slot >= _hiwire.next_slot || _hiwire.refcounts[slot] === 0) {
+			console.error(`idval already released ${idval}`);
+			throw new Error(`idval already released ${idval}`);
+		}
+		return slot;
+	}
+
 	Hiwire.decref = function(idval) {
 		if ((idval & 1) === 0) return;
-		let pair = _hiwire.objects.get(idval);
-		let new_refcnt = --pair[1];
-		if (new_refcnt === 0) {
-			_hiwire.objects.delete(idval);
-			_hiwire.obj_to_key.delete(pair[0]);
+		let slot = live_slot(idval);
+		if (--_hiwire.refcounts[slot] === 0) {
+			_hiwire.values[slot] = undefined;
+			_hiwire.free[_hiwire.free_count++] = slot;
 		}
 	};
 
 	Hiwire.incref = function(idval) {
 		if ((idval & 1) === 0) return;
-		_hiwire.objects.get(idval)[1]++;
+		_hiwire.refcounts[live_slot(idval)]++;
 	};
 
 	Hiwire.pop_value = function(idval) {
@@ -116,34 +293,348 @@ EM_JS(int, js_krk_init, (), {
 		return result;
 	};
 
+	/**
+	 * Strings are passed with explicit lengths, so decode exactly that
+	 * many bytes. TextDecoder refuses views of shared memory, so copy
+	 * those out first.
+	 */
+	const decoder = new TextDecoder('utf-8');
+	Hiwire.decode = function(ptr, len) {
+		let bytes = HEAPU8.subarray(ptr, ptr + len);
+		if (!(HEAPU8.buffer instanceof ArrayBuffer)) bytes = bytes.slice();
+		return decoder.decode(bytes);
+	};
+
+	/* Mirror of the Kuroko-side string cache, see js_string_id */
+	Hiwire.strings = [];
+	Hiwire.string_ids = new Map();
+
+	Hiwire.name = function(id, ptr, len) {
+		return id >= 0 ? Hiwire.strings[id] : Hiwire.decode(ptr, len);
+	};
+
+	/* Keep in sync with struct JsArg */
+	Hiwire.decode_arg = function(p) {
+		let payload = HEAPU32[(p + 8) >> 2];
+		switch (HEAPU32[p >> 2]) {
+			case 0: return Hiwire.pop_value(payload);
+			case 1: return Hiwire.get_value(payload);
+			case 2: return HEAPF64[(p + 8) >> 3];
+			case 3: return Hiwire.decode(payload, HEAPU32[(p + 4) >> 2]);
+			case 4: return Hiwire.strings[payload];
+		}
+	};
+
+	Hiwire.decode_args = function(argv, argc) {
+		let args = new Array(argc);
+		for (let i = 0; i < argc; ++i) {
+			args[i] = Hiwire.decode_arg(argv + i * 16);
+		}
+		return args;
+	};
+
+	Hiwire.encode_arg = function(p, jsval) {
+		if (typeof jsval === 'number') {
+			HEAPU32[p >> 2] = 2;
+			HEAPU32[(p + 4) >> 2] = Number.isSafeInteger(jsval) ? 1 : 0;
+			HEAPF64[(p + 8) >> 3] = jsval;
+		} else if (typeof jsval === 'string') {
+			let id = Hiwire.string_ids.get(jsval);
+			if (id !== undefined) {
+				HEAPU32[p >> 2] = 4;
+				HEAPU32[(p + 8) >> 2] = id;
+			} else {
+				let len = lengthBytesUTF8(jsval);
+				let ptr = _malloc(len + 1);
+				stringToUTF8(jsval, ptr, len + 1);
+				HEAPU32[p >> 2] = 3;
+				HEAPU32[(p + 4) >> 2] = len;
+				HEAPU32[(p + 8) >> 2] = ptr;
+			}
+		} else {
+			HEAPU32[p >> 2] = 0;
+			HEAPU32[(p + 8) >> 2] = Hiwire.new_value(jsval);
+		}
+	};
+
+	/* Keep in sync with enum JsPackTag */
+	Hiwire.reader = function(bytes, borrow) {
+		let view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+		let offset = 0;
+		function u8() {
+			return view.getUint8(offset++);
+		}
+		function u32() {
+			let v = view.getUint32(offset, true);
+			offset += 4;
+			return v;
+		}
+		function copy(n) {
+			offset += n;
+			return bytes.slice(offset - n, offset);
+		}
+		function value() {
+			switch (u8()) {
+				case 0: return undefined;
+				case 1: return null;
+				case 2: return true;
+				case 3: return false;
+				case 4:
+				case 5: {
+					let v = view.getFloat64(offset, true);
+					offset += 8;
+					return v;
+				}
+				case 6: {
+					let n = u32();
+					let v = bytes.subarray(offset, offset + n);
+					if (!(v.buffer instanceof ArrayBuffer)) v = v.slice();
+					offset += n;
+					return decoder.decode(v);
+				}
+				case 7: return borrow ? Hiwire.get_value(u32()) : Hiwire.pop_value(u32());
+				case 8: {
+					let n = u32();
+					let v = new Array(n);
+					for (let i = 0; i < n; ++i) v[i] = value();
+					return v;
+				}
+				case 9: {
+					let n = u32();
+					let v = {};
+					for (let i = 0; i < n; ++i) {
+						let key = value();
+						v[key] = value();
+					}
+					return v;
+				}
+				case 10: {
+					let n = u32();
+					let v = new Set();
+					for (let i = 0; i < n; ++i) v.add(value());
+					return v;
+				}
+				case 11: return copy(u32());
+				case 12: return new Int32Array(copy(u32() * 4).buffer);
+				case 13: return new Float64Array(copy(u32() * 8).buffer);
+			}
+			throw new Error(`bad tag at offset ${offset - 1}`);
+		}
+		return { u8: u8, u32: u32, value: value, offset: () => offset };
+	};
+
+	Hiwire.unpack = function(ptr, len) {
+		return Hiwire.reader(HEAPU8.subarray(ptr, ptr + len)).value();
+	};
+
+	/**
+	 * Replay a command buffer from js.batch(). New nodes are built
+	 * detached; appending them to an existing node goes through one
+	 * DocumentFragment per parent, attached at the end or as soon as
+	 * another command touches that parent, so commands still apply in
+	 * program order. The buffer is copied first, as DOM updates may
+	 * call back into Kuroko. Refs in it are borrowed; the caller
+	 * releases them whether or not the replay finishes. If it fails,
+	 * nodes it created are forgotten, so node indices keep matching the
+	 * batch's count of flushed nodes.
+	 */
+	Hiwire.replay = function(state, ptr, len) {
+		let reader = Hiwire.reader(HEAPU8.slice(ptr, ptr + len), true);
+		let fragments = new Map();
+		let nodes = state.nodes;
+		let flushed = nodes.length;
+		function node() {
+			let kind = reader.u8();
+			let payload = reader.u32();
+			return kind === 0 ? nodes[payload] : Hiwire.get_value(payload);
+		}
+		function target() {
+			let target = node();
+			let fragment = fragments.get(target);
+			if (fragment) {
+				target.appendChild(fragment);
+				fragments.delete(target);
+			}
+			return target;
+		}
+		try {
+			while (reader.offset() < len) {
+				switch (reader.u8()) {
+					case 0: nodes.push(document.createElement(reader.value())); break;
+					case 1: target().textContent = reader.value(); break;
+					case 2: target().innerHTML = reader.value(); break;
+					case 3: {
+						let element = target();
+						let name = reader.value();
+						element[name] = reader.value();
+						break;
+					}
+					case 4: {
+						let element = target();
+						let name = reader.value();
+						element.setAttribute(name, reader.value());
+						break;
+					}
+					case 5: {
+						let parent = node();
+						let child = node();
+						if (!parent.isConnected || child.isConnected) {
+							if (fragments.has(parent)) {
+								parent.appendChild(fragments.get(parent));
+								fragments.delete(parent);
+							}
+							parent.appendChild(child);
+						} else {
+							if (!fragments.has(parent)) fragments.set(parent, document.createDocumentFragment());
+							fragments.get(parent).appendChild(child);
+						}
+						break;
+					}
+				}
+			}
+		} catch (error) {
+			nodes.length = flushed;
+			throw error;
+		} finally {
+			/* Whatever was applied before a failure keeps its appends */
+			for (const [parent, fragment] of fragments) parent.appendChild(fragment);
+		}
+	};
+
+	/**
+	 * Pack a JS value graph for unpack_value. Arrays, plain objects,
+	 * Maps and Sets are walked; byte buffers are copied; anything else
+	 * (functions, DOM nodes, class instances) is passed as a ref.
+	 */
+	const encoder = new TextEncoder();
+	Hiwire.pack = function(root, maxDepth) {
+		let buffer = new Uint8Array(256);
+		let view = new DataView(buffer.buffer);
+		let length = 0;
+		let ancestors = new Set();
+		let refs = [];
+		function reserve(n) {
+			if (length + n > buffer.length) {
+				let size = buffer.length * 2;
+				while (length + n > size) size *= 2;
+				let bigger = new Uint8Array(size);
+				bigger.set(buffer.subarray(0, length));
+				buffer = bigger;
+				view = new DataView(buffer.buffer);
+			}
+			let at = length;
+			length += n;
+			return at;
+		}
+		function tag(t) {
+			buffer[reserve(1)] = t;
+		}
+		function u32(v) {
+			view.setUint32(reserve(4), v, true);
+		}
+		function bytes(t, data) {
+			tag(t);
+			u32(data.length);
+			buffer.set(data, reserve(data.length));
+		}
+		function ref(v) {
+			let id = Hiwire.new_value(v);
+			refs.push(id);
+			tag(7);
+			u32(id);
+		}
+		function value(v, depth) {
+			if (v === undefined) return tag(0);
+			if (v === null) return tag(1);
+			if (v === true) return tag(2);
+			if (v === false) return tag(3);
+			if (typeof v === 'number') {
+				tag(Number.isSafeInteger(v) ? 5 : 4);
+				view.setFloat64(reserve(8), v, true);
+				return;
+			}
+			if (typeof v === 'string') return bytes(6, encoder.encode(v));
+			if (typeof v !== 'object') return ref(v);
+			if (v instanceof ArrayBuffer) return bytes(11, new Uint8Array(v));
+			if (v instanceof Uint8Array || v instanceof Uint8ClampedArray || v instanceof DataView) {
+				return bytes(11, new Uint8Array(v.buffer, v.byteOffset, v.byteLength));
+			}
+			let isArray = Array.isArray(v) || ArrayBuffer.isView(v);
+			let proto = Object.getPrototypeOf(v);
+			if (!isArray && !(v instanceof Map) && !(v instanceof Set) && proto !== Object.prototype && proto !== null) {
+				return ref(v);
+			}
+			if (depth >= maxDepth) throw new RangeError('structure is too deeply nested to convert');
+			if (ancestors.has(v)) throw new TypeError('cannot convert a recursive structure');
+			ancestors.add(v);
+			if (isArray) {
+				tag(8);
+				u32(v.length);
+				for (let i = 0; i < v.length; ++i) value(v[i], depth + 1);
+			} else if (v instanceof Map) {
+				tag(9);
+				u32(v.size);
+				for (const [key, item] of v) {
+					value(key, depth + 1);
+					value(item, depth + 1);
+				}
+			} else if (v instanceof Set) {
+				tag(10);
+				u32(v.size);
+				for (const item of v) value(item, depth + 1);
+			} else {
+				let keys = Object.keys(v);
+				tag(9);
+				u32(keys.length);
+				for (const key of keys) {
+					bytes(6, encoder.encode(key));
+					value(v[key], depth + 1);
+				}
+			}
+			ancestors.delete(v);
+		}
+		try {
+			value(root, 0);
+		} catch (error) {
+			for (const id of refs) Hiwire.decref(id);
+			throw error;
+		}
+		return buffer.subarray(0, length);
+	};
+
 	Hiwire.registry = new FinalizationRegistry(_krk_cleanup);
 
 	return 0;
 });
 
-EM_JS(JsRef, hiwire_int, (int val), {
-	return Hiwire.new_value(val);
-});
-
 EM_JS(JsRef, hiwire_object, (), {
 	return Hiwire.new_value({});
 });
 
 EM_JS(JsRef, hiwire_krk_wrapper, (int id), {
 	let krk_func = function() {
-		let argsid = Hiwire.new_value(arguments);
-		let resid = _krk_call_args(id, argsid);
-		Hiwire.decref(argsid);
-		if (resid != 0) {
-			let output = Hiwire.pop_value(resid);
-			return output;
+		if (arguments.length <= 16) {
+			/* Keep in sync with JS_CALLFRAME_SIZE */
+			for (let i = 0; i < arguments.length; ++i) {
+				Hiwire.encode_arg(_js_callframe + i * 16, arguments[i]);
+			}
+			if (_krk_call_frame(id, arguments.length)) {
+				return Hiwire.decode_arg(_js_callframe);
+			}
 		} else {
-			let jsid = _krk_get_currentException();
-			let jsobj = Hiwire.pop_value(jsid);
-			let error = new Error(jsobj[0]);
-			error.__krkval__ = jsobj[1];
-			throw error;
+			let argsid = Hiwire.new_value(arguments);
+			let resid = _krk_call_args(id, argsid);
+			Hiwire.decref(argsid);
+			if (resid != 0) {
+				let output = Hiwire.pop_value(resid);
+				return output;
+			}
 		}
+		let jsid = _krk_get_currentException();
+		let jsobj = Hiwire.pop_value(jsid);
+		let error = new Error(jsobj[0]);
+		error.__krkval__ = jsobj[1];
+		throw error;
 	};
 	krk_func.__krk__ = true;
 	krk_func.__id__ = id;
@@ -166,17 +657,14 @@ EM_JS(JsRef, hiwire_args_get, (JsRef idval, int arg), {
 	return Hiwire.new_value(jsobj[arg]);
 });
 
-EM_JS(JsRef, hiwire_float, (double val), {
-	return Hiwire.new_value(val);
-});
-
-EM_JS(JsRef, hiwire_string_utf8, (const char* ptr), {
-	return Hiwire.new_value(UTF8ToString(ptr));
+EM_JS(JsRef, hiwire_string, (int id, const char* ptr, size_t len), {
+	return Hiwire.new_value(Hiwire.name(id, ptr, len));
 });
 
-EM_JS(double, hiwire_out_float, (JsRef idval), {
-	let jsobj = Hiwire.get_value(idval);
-	return jsobj;
+EM_JS(void, hiwire_intern_string, (int id, const char* ptr, size_t len), {
+	let jsstr = Hiwire.decode(ptr, len);
+	Hiwire.strings[id] = jsstr;
+	Hiwire.string_ids.set(jsstr, id);
 });
 
 EM_JS(void, hiwire_decref, (JsRef idval), {
@@ -211,13 +699,17 @@ EM_JS(JsRef, hiwire_to_string, (JsRef idobj), {
 	return Hiwire.new_value(jsstr);
 });
 
-EM_JS(char *, hiwire_to_str, (JsRef idobj), {
+EM_JS(int, hiwire_to_str, (JsRef idobj, char ** out, size_t * len), {
 	var output = Hiwire.get_value(idobj);
 	if (typeof output !== 'string') output = '<undefined>';
-	var bytes = lengthBytesUTF8(output)+1;
-	var heapObj = _malloc(bytes);
-	stringToUTF8(output, heapObj, bytes);
-	return heapObj;
+	var id = Hiwire.string_ids.get(output);
+	if (id !== undefined) return id + 1;
+	var bytes = lengthBytesUTF8(output);
+	var heapObj = _malloc(bytes+1);
+	stringToUTF8(output, heapObj, bytes+1);
+	HEAPU32[out >> 2] = heapObj;
+	HEAPU32[len >> 2] = bytes;
+	return 0;
 });
 
 EM_JS(JsRef, hiwire_get_error, (), {
@@ -240,31 +732,41 @@ EM_JS(void, obj_setitem, (JsRef idobj, JsRef idkey, JsRef idval), {
 	jsobj[jskey] = jsval;
 });
 
-EM_JS(JsRef, obj_getattr, (JsRef idobj, const char *name), {
+EM_JS(JsRef, obj_getattr, (JsRef idobj, int nameid, const char *name, size_t len), {
+	let jsobj = Hiwire.get_value(idobj);
+	let jskey = Hiwire.name(nameid, name, len);
+	let result = jsobj[jskey];
+	if (result === undefined && !(jskey in jsobj)) return 0;
+	return Hiwire.new_value(result);
+});
+
+/* As obj_getattr, but plain JS functions are reported as Js_novalue without making a handle */
+EM_JS(JsRef, obj_getmethod, (JsRef idobj, int nameid, const char *name, size_t len), {
 	let jsobj = Hiwire.get_value(idobj);
-	let jskey = UTF8ToString(name);
+	let jskey = Hiwire.name(nameid, name, len);
 	let result = jsobj[jskey];
 	if (result === undefined && !(jskey in jsobj)) return 0;
+	if (typeof result === 'function' && !result.__krk__) return Hiwire.NOVALUE;
 	return Hiwire.new_value(result);
 });
 
-EM_JS(void, obj_setattr, (JsRef idobj, const char *name, JsRef idval), {
+EM_JS(void, obj_setattr, (JsRef idobj, int nameid, const char *name, size_t len, JsRef idval), {
 	let jsobj = Hiwire.get_value(idobj);
-	let jskey = UTF8ToString(name);
+	let jskey = Hiwire.name(nameid, name, len);
 	let jsval = Hiwire.get_value(idval);
 	jsobj[jskey] = jsval;
 });
 
-EM_JS(void, obj_delattr, (JsRef idobj, const char *name), {
+EM_JS(void, obj_delattr, (JsRef idobj, int nameid, const char *name, size_t len), {
 	let jsobj = Hiwire.get_value(idobj);
-	let jskey = UTF8ToString(name);
+	let jskey = Hiwire.name(nameid, name, len);
 	delete jsobj[jskey];
 });
 
-EM_JS(JsRef, obj_call, (JsRef idobj, JsRef idthis, JsRef idargs), {
+EM_JS(JsRef, obj_call, (JsRef idobj, JsRef idthis, struct JsArg * argv, int argc), {
 	let jsfunc = Hiwire.get_value(idobj);
 	let jsthis = idthis === 0 ? null : Hiwire.get_value(idthis);
-	let jsargs = Hiwire.get_value(idargs);
+	let jsargs = Hiwire.decode_args(argv, argc);
 	try {
 		return Hiwire.new_value(jsfunc.apply(jsthis,jsargs));
 	} catch (error) {
@@ -274,6 +776,18 @@ EM_JS(JsRef, obj_call, (JsRef idobj, JsRef idthis, JsRef idargs), {
 	}
 });
 
+EM_JS(JsRef, obj_call_method, (JsRef idthis, int nameid, const char *name, size_t len, struct JsArg * argv, int argc), {
+	let jsargs = Hiwire.decode_args(argv, argc);
+	let jsthis = Hiwire.get_value(idthis);
+	try {
+		return Hiwire.new_value(jsthis[Hiwire.name(nameid, name, len)].apply(jsthis,jsargs));
+	} catch (error) {
+		console.log(error);
+		Hiwire.exception = error;
+		return 0;
+	}
+});
+
 EM_JS(JsRef, obj_dir, (JsRef idobj), {
 	let jsobj = Hiwire.get_value(idobj);
 	let result = [];
@@ -296,22 +810,126 @@ EM_JS(int, obj_isstring, (JsRef idobj), {
 	return typeof Hiwire.get_value(idobj) === 'string';
 });
 
-EM_JS(int, obj_isnumber, (JsRef idobj), {
+EM_JS(int, obj_iskrk, (JsRef idobj), {
 	let jsobj = Hiwire.get_value(idobj);
-	if (typeof jsobj === 'number') {
-		return Number.isSafeInteger(jsobj) ? 2 : 1;
+	if (typeof jsobj === 'function') {
+		return jsobj.hasOwnProperty('__krk__') && jsobj.hasOwnProperty('__id__');
 	}
 	return 0;
 });
 
-EM_JS(int, obj_iskrk, (JsRef idobj), {
+EM_JS(JsRef, hiwire_unpack, (const uint8_t * data, size_t length), {
+	return Hiwire.new_value(Hiwire.unpack(data, length));
+});
+
+EM_JS(uint8_t *, hiwire_pack, (JsRef idobj, int maxDepth, size_t * length), {
+	try {
+		let packed = Hiwire.pack(Hiwire.get_value(idobj), maxDepth);
+		let ptr = _malloc(packed.length);
+		HEAPU8.set(packed, ptr);
+		HEAPU32[length >> 2] = packed.length;
+		return ptr;
+	} catch (error) {
+		Hiwire.exception = error;
+		return 0;
+	}
+});
+
+/**
+ * A Uint8Array over the heap; `pin` is a slot in the pin table keeping
+ * the owning bytes object alive, released through the registry once the
+ * view is collected (pins are passed to krk_cleanup as -1 - pin). Views
+ * detach if memory grows.
+ */
+EM_JS(JsRef, hiwire_bytes_view, (uint8_t * ptr, size_t length, int pin), {
+	let view = new Uint8Array(HEAPU8.buffer, ptr, length);
+	Hiwire.registry.register(view, -1 - pin);
+	return Hiwire.new_value(view);
+});
+
+/* A Uint8Array with a copy of some of the heap */
+EM_JS(JsRef, hiwire_bytes_copy, (const uint8_t * ptr, size_t length), {
+	return Hiwire.new_value(HEAPU8.slice(ptr, ptr + length));
+});
+
+EM_JS(int, hiwire_byte_length, (JsRef idobj), {
 	let jsobj = Hiwire.get_value(idobj);
-	if (typeof jsobj === 'function') {
-		return jsobj.hasOwnProperty('__krk__') && jsobj.hasOwnProperty('__id__');
+	if (jsobj instanceof ArrayBuffer || ArrayBuffer.isView(jsobj)) return jsobj.byteLength;
+	return -1;
+});
+
+EM_JS(void, hiwire_copy_bytes, (JsRef idobj, uint8_t * dest), {
+	let jsobj = Hiwire.get_value(idobj);
+	if (jsobj instanceof ArrayBuffer) {
+		HEAPU8.set(new Uint8Array(jsobj), dest);
+	} else {
+		HEAPU8.set(new Uint8Array(jsobj.buffer, jsobj.byteOffset, jsobj.byteLength), dest);
+	}
+});
+
+EM_JS(JsRef, obj_iter, (JsRef idobj), {
+	let jsobj = Hiwire.get_value(idobj);
+	if (Array.isArray(jsobj) || ArrayBuffer.isView(jsobj)) {
+		return Hiwire.new_value({ obj: jsobj, index: 0 });
+	} else if (typeof jsobj[Symbol.iterator] === 'function') {
+		return Hiwire.new_value({ it: jsobj[Symbol.iterator]() });
+	} else if (typeof jsobj.length === 'number') {
+		return Hiwire.new_value({ obj: jsobj, index: 0 });
 	}
 	return 0;
 });
 
+/* Returns the number of entries written, or -(count+1) if the iterator threw */
+EM_JS(int, obj_iter_fill, (JsRef iditer, struct JsArg * out, int max), {
+	let state = Hiwire.get_value(iditer);
+	let n = 0;
+	try {
+		if (state.it) {
+			while (n < max) {
+				let result = state.it.next();
+				if (result.done) break;
+				Hiwire.encode_arg(out + n * 16, result.value);
+				n++;
+			}
+		} else {
+			let obj = state.obj;
+			while (n < max && state.index < obj.length) {
+				Hiwire.encode_arg(out + n * 16, obj[state.index++]);
+				n++;
+			}
+		}
+	} catch (error) {
+		Hiwire.exception = error;
+		return -(n + 1);
+	}
+	return n;
+});
+
+EM_JS(int, obj_length, (JsRef idobj), {
+	let jsobj = Hiwire.get_value(idobj);
+	if (typeof jsobj.length === 'number') return jsobj.length;
+	if (typeof jsobj.size === 'number') return jsobj.size;
+	return -1;
+});
+
+EM_JS(JsRef, batch_new_state, (), {
+	return Hiwire.new_value({ nodes: [] });
+});
+
+EM_JS(JsRef, batch_replay, (JsRef idstate, const uint8_t * data, size_t length), {
+	try {
+		Hiwire.replay(Hiwire.get_value(idstate), data, length);
+		return Hiwire.TRUE;
+	} catch (error) {
+		Hiwire.exception = error;
+		return 0;
+	}
+});
+
+EM_JS(JsRef, batch_node, (JsRef idstate, int index), {
+	return Hiwire.new_value(Hiwire.get_value(idstate).nodes[index]);
+});
+
 EM_JS(JsRef, JsArray_New, (), {
 	return Hiwire.new_value([]);
 });
@@ -330,6 +948,13 @@ EM_JS(JsRef, JsArray_Get, (JsRef idobj, int ind), {
 /**
  * Everything from here onwards is the Kuroko bindings.
  */
+static void _jsobject_ongcscan(KrkInstance * self) {
+	struct JSObject * _self = (void*)self;
+	if (_self->name) krk_markObject((KrkObj*)_self->name);
+	if (_self->receiver) krk_markObject((KrkObj*)_self->receiver);
+	if (_self->method) krk_markObject((KrkObj*)_self->method);
+}
+
 static void _jsobject_ongcsweep(KrkInstance * self) {
 	struct JSObject * _self = (void*)self;
 	if (_self->js) {
@@ -345,9 +970,192 @@ static void _jsobject_ongcsweep(KrkInstance * self) {
 
 #define IS_method(o)     IS_BOUND_METHOD(o)
 #define IS_function(o)   (IS_CLOSURE(o)|IS_NATIVE(o))
-static KrkValue _objToId;
-static KrkValue _objects;
-static uint32_t counter = 0;
+/**
+ * Kuroko values exported to JS as callables are kept in a slab of slots
+ * with plain refcounts; released slots are chained into a free list.
+ * The slab belongs to an instance attached to the js module, whose
+ * _ongcscan marks every live value.
+ */
+struct ProxySlot {
+	KrkValue value;
+	uint32_t refcount;
+	uint32_t next; /* Next free slot + 1, while on the free list */
+};
+
+struct ProxyTable {
+	KrkInstance inst;
+	struct ProxySlot * slots;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t freeList; /* First free slot + 1, or 0 */
+	KrkTable ids;      /* value -> slot index */
+};
+
+static struct ProxyTable * proxies;
+
+static void _proxytable_ongcscan(KrkInstance * self) {
+	struct ProxyTable * _self = (void*)self;
+	for (uint32_t i = 0; i < _self->count; ++i) {
+		if (_self->slots[i].refcount) krk_markValue(_self->slots[i].value);
+	}
+	krk_markTable(&_self->ids);
+}
+
+static void _proxytable_ongcsweep(KrkInstance * self) {
+	struct ProxyTable * _self = (void*)self;
+	free(_self->slots);
+	krk_freeTable(&_self->ids);
+}
+
+/**
+ * Buffers shared by js.view are pinned in a second table, one slot per
+ * view. It never uses `ids`: that matches keys by equality, so a bytes
+ * object equal to one already pinned would share its slot and not be
+ * pinned itself.
+ */
+static struct ProxyTable * pins;
+
+static uint32_t slot_take(struct ProxyTable * table, KrkValue val) {
+	uint32_t index;
+	if (table->freeList) {
+		index = table->freeList - 1;
+		table->freeList = table->slots[index].next;
+	} else {
+		if (table->count == table->capacity) {
+			table->capacity = table->capacity ? table->capacity * 2 : 64;
+			table->slots = realloc(table->slots, sizeof(struct ProxySlot) * table->capacity);
+		}
+		index = table->count++;
+	}
+
+	table->slots[index].value = val;
+	table->slots[index].refcount = 1;
+	return index;
+}
+
+static void slot_free(struct ProxyTable * table, uint32_t index) {
+	table->slots[index].value = NONE_VAL();
+	table->slots[index].next = table->freeList;
+	table->freeList = index + 1;
+}
+
+static uint32_t proxy_acquire(KrkValue val) {
+	KrkValue id;
+	if (krk_tableGet(&proxies->ids, val, &id)) {
+		proxies->slots[AS_INTEGER(id)].refcount++;
+		return AS_INTEGER(id);
+	}
+
+	uint32_t index = slot_take(proxies, val);
+	krk_tableSet(&proxies->ids, val, INTEGER_VAL(index));
+	return index;
+}
+
+static int proxy_get(uint32_t index, KrkValue * out) {
+	if (index >= proxies->count || !proxies->slots[index].refcount) return 0;
+	*out = proxies->slots[index].value;
+	return 1;
+}
+
+static void proxy_release(uint32_t index) {
+	if (index >= proxies->count || !proxies->slots[index].refcount) return;
+	if (--proxies->slots[index].refcount) return;
+	krk_tableDelete(&proxies->ids, proxies->slots[index].value);
+	slot_free(proxies, index);
+}
+
+static void pin_release(uint32_t index) {
+	if (index >= pins->count || !pins->slots[index].refcount) return;
+	if (--pins->slots[index].refcount) return;
+	slot_free(pins, index);
+}
+
+/**
+ * Strings used as attribute names are interned on both sides: the
+ * Kuroko string is kept in _strings at its id, and the JS side holds
+ * the decoded string at the same index. Hot names like 'style' or
+ * 'push' are then decoded once per session instead of on every access.
+ */
+#define JS_STRING_CACHE_MAX 4096
+static KrkValue _strings;
+static KrkValue _stringIds;
+
+static int js_string_id(KrkString * str, int insert) {
+	KrkValue id;
+	if (krk_tableGet(AS_DICT(_stringIds), OBJECT_VAL(str), &id)) return AS_INTEGER(id);
+	if (!insert || AS_LIST(_strings)->count >= JS_STRING_CACHE_MAX) return -1;
+	int newId = AS_LIST(_strings)->count;
+	krk_writeValueArray(AS_LIST(_strings), OBJECT_VAL(str));
+	krk_tableSet(AS_DICT(_stringIds), OBJECT_VAL(str), INTEGER_VAL(newId));
+	hiwire_intern_string(newId, str->chars, str->length);
+	return newId;
+}
+
+static JsRef js_getattr(JsRef obj, KrkString * name) {
+	return obj_getattr(obj, js_string_id(name, 1), name->chars, name->length);
+}
+
+static void js_setattr(JsRef obj, KrkString * name, JsRef val) {
+	obj_setattr(obj, js_string_id(name, 1), name->chars, name->length, val);
+}
+
+static JsRef js_string(KrkString * str) {
+	return hiwire_string(js_string_id(str, 0), str->chars, str->length);
+}
+
+/**
+ * Methods fetched through __getattr__ are not bound to a handle until
+ * something other than a call needs one; calls look the function up
+ * by name on the receiver, see obj_call_method. So unlike a bound
+ * method, a method object sees the property as it is when called: if
+ * the JS side replaces it after the fetch, the call uses the new one.
+ * If the property has become a number, its ref is an immediate that only
+ * lasts until the ring wraps, so it is looked up again on every use
+ * instead of being kept.
+ */
+static JsRef jsRef(struct JSObject * self) {
+	if (!self->js && self->name) {
+		JsRef ref = js_getattr(jsRef(self->receiver), self->name);
+		if (!ref) ref = Js_undefined;
+		if (JS_IS_IMMEDIATE(ref)) return ref;
+		self->js = ref;
+		self->this = self->receiver->js;
+	}
+	return self->js;
+}
+
+/**
+ * Convert a JS string to a Kuroko string. Cached strings come back as
+ * an id; anything else is encoded into a fresh buffer along with its
+ * length, and krk_takeString takes ownership of it.
+ */
+static KrkValue stringFromJs(JsRef ref) {
+	char * chars;
+	size_t length;
+	int id = hiwire_to_str(ref, &chars, &length);
+	if (id) return AS_LIST(_strings)->values[id-1];
+	return OBJECT_VAL(krk_takeString(chars, length));
+}
+
+/**
+ * JS only has 'numbers' so we should try to be a bit smarter...
+ */
+static KrkValue fromJsNumber(double val, int isInt) {
+	if (isInt) { /* Number.isSafeInteger() was true */
+		long long asInt = val;
+		if (val < 0x800000000000LL && val > -0x800000000000LL) {
+			/* For sufficiently small ints, produce an int */
+			return INTEGER_VAL(val);
+		}
+		/* For larger integer numbers, give up and try to string parse them into longs */
+		char tmp[100];
+		snprintf(tmp, 100, "%lld", asInt);
+		return krk_parse_int(tmp, strlen(tmp), 10);
+	} else {
+		/* Number.isSafeInteger() was false; this is a double. */
+		return FLOATING_VAL(val);
+	}
+}
 
 /* Generally based on js2python */
 static KrkValue fromJs(JsRef ref, JsRef this_) {
@@ -357,44 +1165,22 @@ static KrkValue fromJs(JsRef ref, JsRef this_) {
 	if (ref == Js_true) return BOOLEAN_VAL(1);
 	if (ref == Js_false) return BOOLEAN_VAL(0);
 
-	int r;
-	if ((r = obj_isnumber(ref))) {
-		/**
-		 * JS only has 'numbers' so we should try to be a bit smarter...
-		 */
-		double val = hiwire_out_float(ref);
-		hiwire_decref(ref);
-		if (r == 2) { /* Number.isSafeInteger() was true */
-			long long asInt = val;
-			if (val < 0x800000000000LL && val > -0x800000000000LL) {
-				/* For sufficiently small ints, produce an int */
-				return INTEGER_VAL(val);
-			}
-			/* For larger integer numbers, give up and try to string parse them into longs */
-			char tmp[100];
-			snprintf(tmp, 100, "%lld", asInt);
-			return krk_parse_int(tmp, strlen(tmp), 10);
-		} else {
-			/* Number.isSafeInteger() was false; this is a double. */
-			return FLOATING_VAL(val);
-		}
+	if (JS_IS_IMMEDIATE(ref)) {
+		return fromJsNumber(js_immediates[JS_IMMEDIATE_SLOT(ref)], JS_IMMEDIATE_ISINT(ref));
 	}
 
 	if (obj_isstring(ref)) {
-		char * asString = hiwire_to_str(ref);
-		krk_push(OBJECT_VAL(krk_takeString(asString,strlen(asString))));
+		krk_push(stringFromJs(ref));
 		hiwire_decref(ref);
 		return krk_pop();
 	}
 
 	if (obj_iskrk(ref)) {
 		/* Extract value, and decref */
-		KrkValue id = INTEGER_VAL(hiwire_out_krk(ref));
-		KrkValue objList;
-		if (krk_tableGet(AS_DICT(_objects), id, &objList)) {
-			krk_push(AS_LIST(objList)->values[0]);
+		KrkValue value;
+		if (proxy_get(hiwire_out_krk(ref), &value)) {
 			hiwire_decref(ref);
-			return krk_pop();
+			return value;
 		} else {
 			hiwire_decref(ref);
 			return krk_runtimeError(vm.exceptions->typeError, "invalid object?\n");
@@ -412,58 +1198,377 @@ static KrkValue fromJs(JsRef ref, JsRef this_) {
 }
 
 static JsRef make_proxy(KrkValue val) {
-	KrkValue id;
-	if (krk_tableGet(AS_DICT(_objToId), val, &id)) {
-		/* Already exists, increment */
-		KrkValue objList;
-		krk_tableGet(AS_DICT(_objects), id, &objList);
-		AS_LIST(objList)->values[1] = INTEGER_VAL(AS_INTEGER(AS_LIST(objList)->values[1])+1);
-		/* return id */
-	} else {
-		/* Make a new one */
-		KrkValue garbage;
-		while (krk_tableGet(AS_DICT(_objects), INTEGER_VAL(counter), &garbage)) {
-			counter++;
-		}
-		id = INTEGER_VAL(counter);
+	/* Wrap the slot index; the wrapper releases it when collected */
+	return hiwire_krk_wrapper(proxy_acquire(val));
+}
 
-		krk_push(krk_list_of(2,(KrkValue[]){ val, INTEGER_VAL(1)},0));
-		krk_tableSet(AS_DICT(_objects), id, krk_peek(0));
-		krk_pop();
-		krk_tableSet(AS_DICT(_objToId), val, id);
+/* Decode one JsArg filled in by JS, taking ownership of whatever it holds */
+static KrkValue fromJsArg(struct JsArg * arg) {
+	switch (arg->type) {
+		case JS_ARG_NUMBER:
+			return fromJsNumber(arg->as.number, arg->length);
+		case JS_ARG_STRING:
+			return OBJECT_VAL(krk_takeString((char*)arg->as.chars, arg->length));
+		case JS_ARG_CACHED:
+			return AS_LIST(_strings)->values[arg->as.id];
+		case JS_ARG_REF:
+			return fromJs(arg->as.ref, 0);
+		default:
+			return NONE_VAL();
 	}
-
-	/* Now we need to wrap the value */
-	return hiwire_krk_wrapper(AS_INTEGER(id));
 }
 
-static JsRef fromKrk(KrkValue val) {
-	if (IS_JSObject(val)) {
-		JsRef out = AS_JSObject(val)->js;
-		hiwire_incref(out);
-		return out;
-	} if (IS_STRING(val)) {
-		return hiwire_string_utf8(AS_CSTRING(val));
-	} else if (IS_BOOLEAN(val)) {
-		return AS_BOOLEAN(val) ? Js_true : Js_false;
+/**
+ * Turn Hiwire.exception into a Kuroko exception. Errors thrown by
+ * Kuroko code called from JS carry the original in __krkval__.
+ */
+static KrkValue raiseJsException(void) {
+	JsRef excp = hiwire_get_error();
+	JsRef maybe_krk = js_getattr(excp, S("__krkval__"));
+	if (maybe_krk) {
+		hiwire_decref(excp);
+		krk_currentThread.currentException = fromJs(maybe_krk,0);
+		krk_currentThread.flags |= KRK_THREAD_HAS_EXCEPTION;
+	} else {
+		JsRef name = js_getattr(excp,S("name"));
+		JsRef msg  = js_getattr(excp,S("message"));
+		hiwire_decref(excp);
+
+		if (name) {
+			krk_push(stringFromJs(name));
+			hiwire_decref(name);
+		} else {
+			krk_push(OBJECT_VAL(S("(unnamed)")));
+		}
+
+		if (msg) {
+			krk_push(stringFromJs(msg));
+			hiwire_decref(msg);
+		} else {
+			krk_push(OBJECT_VAL(S("")));
+		}
+
+		const char * _name = AS_CSTRING(krk_peek(1));
+		const char * _msg  = AS_CSTRING(krk_peek(0));
+
+		if (!strcmp(_name, "TypeError")) {
+			krk_runtimeError(vm.exceptions->typeError, "%s", _msg);
+		} else if (!strcmp(_name, "ReferenceError")) {
+			krk_runtimeError(vm.exceptions->nameError, "%s", _msg);
+		} else {
+			krk_runtimeError(vm.exceptions->valueError, "%s: %s", _name, _msg);
+		}
+
+		krk_pop();
+		krk_pop();
+	}
+	return NONE_VAL();
+}
+
+struct JsUnpacker {
+	const uint8_t * data;
+	size_t offset;
+};
+
+static uint32_t unpack_u32(struct JsUnpacker * u) {
+	uint32_t val;
+	memcpy(&val, u->data + u->offset, sizeof(val));
+	u->offset += sizeof(val);
+	return val;
+}
+
+static double unpack_f64(struct JsUnpacker * u) {
+	double val;
+	memcpy(&val, u->data + u->offset, sizeof(val));
+	u->offset += sizeof(val);
+	return val;
+}
+
+/**
+ * Build Kuroko values from a buffer packed by Hiwire.pack. Containers
+ * collect their contents on the stack and are built in one go. The
+ * whole buffer is always consumed so every ref in it is released, even
+ * if building something raised along the way.
+ */
+static KrkValue unpack_value(struct JsUnpacker * u) {
+	switch (u->data[u->offset++]) {
+		case JS_PACK_UNDEFINED:
+		case JS_PACK_NULL:
+			return NONE_VAL();
+		case JS_PACK_TRUE:
+			return BOOLEAN_VAL(1);
+		case JS_PACK_FALSE:
+			return BOOLEAN_VAL(0);
+		case JS_PACK_NUMBER:
+			return fromJsNumber(unpack_f64(u), 0);
+		case JS_PACK_INTEGER:
+			return fromJsNumber(unpack_f64(u), 1);
+		case JS_PACK_STRING: {
+			uint32_t length = unpack_u32(u);
+			KrkString * str = krk_copyString((const char*)u->data + u->offset, length);
+			u->offset += length;
+			return OBJECT_VAL(str);
+		}
+		case JS_PACK_BYTES: {
+			uint32_t length = unpack_u32(u);
+			KrkBytes * bytes = krk_newBytes(length, (uint8_t*)u->data + u->offset);
+			u->offset += length;
+			return OBJECT_VAL(bytes);
+		}
+		case JS_PACK_REF:
+			return fromJs((JsRef)(uintptr_t)unpack_u32(u), 0);
+		case JS_PACK_ARRAY:
+		case JS_PACK_SET: {
+			int isSet = u->data[u->offset-1] == JS_PACK_SET;
+			uint32_t count = unpack_u32(u);
+			for (uint32_t i = 0; i < count; ++i) krk_push(unpack_value(u));
+			KrkValue out = isSet ?
+				krk_set_of(count, &krk_currentThread.stackTop[-count], 0) :
+				krk_list_of(count, &krk_currentThread.stackTop[-count], 0);
+			krk_currentThread.stackTop -= count;
+			return out;
+		}
+		case JS_PACK_OBJECT: {
+			uint32_t count = unpack_u32(u);
+			for (uint32_t i = 0; i < count * 2; ++i) krk_push(unpack_value(u));
+			KrkValue out = krk_dict_of(count * 2, &krk_currentThread.stackTop[-count * 2], 0);
+			krk_currentThread.stackTop -= count * 2;
+			return out;
+		}
+	}
+	return krk_runtimeError(vm.exceptions->valueError, "corrupt packed value");
+}
+
+static KrkValue unpackFromJs(JsRef ref, int maxDepth) {
+	size_t length;
+	uint8_t * data = hiwire_pack(ref, maxDepth, &length);
+	if (!data) return raiseJsException();
+	struct JsUnpacker u = {data, 0};
+	krk_push(unpack_value(&u));
+	free(data);
+	if (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION) {
+		krk_pop();
+		return NONE_VAL();
+	}
+	return krk_pop();
+}
+
+static JsRef fromKrk(KrkValue val);
+
+struct JsPacker {
+	uint8_t * data;
+	size_t length;
+	size_t capacity;
+	int depth;
+	int typed;   /* Pack homogeneous numeric lists as typed arrays */
+	JsRef * refs; /* Owned refs written so far, released on failure */
+	size_t refCount;
+	size_t refCapacity;
+};
+
+static uint8_t * pack_reserve(struct JsPacker * p, size_t size) {
+	if (p->length + size > p->capacity) {
+		while (p->length + size > p->capacity) p->capacity = p->capacity ? p->capacity * 2 : 256;
+		p->data = realloc(p->data, p->capacity);
+	}
+	uint8_t * out = p->data + p->length;
+	p->length += size;
+	return out;
+}
+
+static void pack_tag(struct JsPacker * p, enum JsPackTag tag) {
+	*pack_reserve(p, 1) = tag;
+}
+
+static void pack_u32(struct JsPacker * p, uint32_t val) {
+	memcpy(pack_reserve(p, sizeof(val)), &val, sizeof(val));
+}
+
+static void pack_f64(struct JsPacker * p, double val) {
+	memcpy(pack_reserve(p, sizeof(val)), &val, sizeof(val));
+}
+
+static void pack_bytes(struct JsPacker * p, enum JsPackTag tag, const void * data, size_t length) {
+	pack_tag(p, tag);
+	pack_u32(p, length);
+	memcpy(pack_reserve(p, length), data, length);
+}
+
+static int pack_ref(struct JsPacker * p, JsRef ref) {
+	if (!ref) return 0;
+	if (p->refCount == p->refCapacity) {
+		p->refCapacity = p->refCapacity ? p->refCapacity * 2 : 16;
+		p->refs = realloc(p->refs, sizeof(JsRef) * p->refCapacity);
+	}
+	p->refs[p->refCount++] = ref;
+	pack_tag(p, JS_PACK_REF);
+	pack_u32(p, (uintptr_t)ref);
+	return 1;
+}
+
+static int pack_value(struct JsPacker * p, KrkValue val);
+
+static int pack_sequence(struct JsPacker * p, size_t count, const KrkValue * values) {
+	if (p->typed && count) {
+		int ints = 1, numbers = 1;
+		for (size_t i = 0; i < count && numbers; ++i) {
+			if (IS_BOOLEAN(values[i])) {
+				ints = numbers = 0;
+			} else if (IS_INTEGER(values[i])) {
+				if (AS_INTEGER(values[i]) < INT32_MIN || AS_INTEGER(values[i]) > INT32_MAX) ints = 0;
+			} else if (IS_FLOATING(values[i])) {
+				ints = 0;
+			} else {
+				ints = numbers = 0;
+			}
+		}
+		if (ints) {
+			pack_tag(p, JS_PACK_INT32ARRAY);
+			pack_u32(p, count);
+			int32_t * out = (int32_t*)pack_reserve(p, sizeof(int32_t) * count);
+			for (size_t i = 0; i < count; ++i) {
+				int32_t v = AS_INTEGER(values[i]);
+				memcpy(&out[i], &v, sizeof(v));
+			}
+			return 1;
+		} else if (numbers) {
+			pack_tag(p, JS_PACK_FLOAT64ARRAY);
+			pack_u32(p, count);
+			double * out = (double*)pack_reserve(p, sizeof(double) * count);
+			for (size_t i = 0; i < count; ++i) {
+				double v = IS_INTEGER(values[i]) ? (double)AS_INTEGER(values[i]) : AS_FLOATING(values[i]);
+				memcpy(&out[i], &v, sizeof(v));
+			}
+			return 1;
+		}
+	}
+
+	pack_tag(p, JS_PACK_ARRAY);
+	pack_u32(p, count);
+	for (size_t i = 0; i < count; ++i) {
+		if (!pack_value(p, values[i])) return 0;
+	}
+	return 1;
+}
+
+static int pack_dict(struct JsPacker * p, KrkTable * table) {
+	pack_tag(p, JS_PACK_OBJECT);
+	size_t countOffset = p->length;
+	pack_u32(p, 0);
+	uint32_t count = 0;
+	for (size_t i = 0; i < table->capacity; ++i) {
+		KrkTableEntry * entry = &table->entries[i];
+		if (IS_KWARGS(entry->key)) continue;
+		if (!pack_value(p, entry->key)) return 0;
+		if (!pack_value(p, entry->value)) return 0;
+		count++;
+	}
+	memcpy(p->data + countOffset, &count, sizeof(count));
+	return 1;
+}
+
+struct JsSetPacker {
+	struct JsPacker * p;
+	uint32_t count;
+};
+
+static int _pack_set_entries(void * context, const KrkValue * values, size_t count) {
+	struct JsSetPacker * s = context;
+	for (size_t i = 0; i < count; ++i) {
+		if (!pack_value(s->p, values[i])) return 1;
+		s->count++;
+	}
+	return 0;
+}
+
+static int pack_set(struct JsPacker * p, KrkValue set) {
+	pack_tag(p, JS_PACK_SET);
+	size_t countOffset = p->length;
+	pack_u32(p, 0);
+	struct JsSetPacker s = {p, 0};
+	if (krk_unpackIterable(set, &s, _pack_set_entries)) return 0;
+	if (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION) return 0;
+	memcpy(p->data + countOffset, &s.count, sizeof(s.count));
+	return 1;
+}
+
+static int pack_value(struct JsPacker * p, KrkValue val) {
+	if (p->depth >= JS_PACK_MAX_DEPTH) {
+		krk_runtimeError(vm.exceptions->valueError, "structure is too deeply nested (or recursive) to convert");
+		return 0;
+	}
+
+	int result = 1;
+	p->depth++;
+	if (IS_NONE(val)) {
+		pack_tag(p, JS_PACK_UNDEFINED);
+	} else if (IS_BOOLEAN(val)) {
+		pack_tag(p, AS_BOOLEAN(val) ? JS_PACK_TRUE : JS_PACK_FALSE);
+	} else if (IS_INTEGER(val)) {
+		pack_tag(p, JS_PACK_INTEGER);
+		pack_f64(p, AS_INTEGER(val));
+	} else if (IS_FLOATING(val)) {
+		pack_tag(p, JS_PACK_NUMBER);
+		pack_f64(p, AS_FLOATING(val));
+	} else if (IS_STRING(val)) {
+		pack_bytes(p, JS_PACK_STRING, AS_CSTRING(val), AS_STRING(val)->length);
+	} else if (IS_list(val)) {
+		result = pack_sequence(p, AS_LIST(val)->count, AS_LIST(val)->values);
+	} else if (IS_TUPLE(val)) {
+		result = pack_sequence(p, AS_TUPLE(val)->values.count, AS_TUPLE(val)->values.values);
+	} else if (IS_dict(val)) {
+		result = pack_dict(p, AS_DICT(val));
+	} else if (krk_isInstanceOf(val, vm.baseClasses->setClass)) {
+		result = pack_set(p, val);
+	} else if (IS_BYTES(val)) {
+		pack_bytes(p, JS_PACK_BYTES, AS_BYTES(val)->bytes, AS_BYTES(val)->length);
+	} else if (IS_bytearray(val)) {
+		KrkBytes * bytes = AS_BYTES(AS_bytearray(val)->actual);
+		pack_bytes(p, JS_PACK_BYTES, bytes->bytes, bytes->length);
+	} else {
+		result = pack_ref(p, fromKrk(val));
+	}
+	p->depth--;
+	return result;
+}
+
+/**
+ * Convert a whole Kuroko value graph to JS in one crossing. With `typed`,
+ * lists and tuples of only ints (in int32 range) or only numbers become
+ * Int32Arrays or Float64Arrays.
+ */
+static JsRef packToJs(KrkValue val, int typed) {
+	struct JsPacker p = {0};
+	p.typed = typed;
+	JsRef out = 0;
+	if (pack_value(&p, val)) {
+		out = hiwire_unpack(p.data, p.length);
+	} else {
+		for (size_t i = 0; i < p.refCount; ++i) hiwire_decref(p.refs[i]);
+	}
+	free(p.data);
+	free(p.refs);
+	return out;
+}
+
+static JsRef fromKrk(KrkValue val) {
+	if (IS_JSObject(val)) {
+		JsRef out = jsRef(AS_JSObject(val));
+		hiwire_incref(out);
+		return out;
+	} if (IS_STRING(val)) {
+		return js_string(AS_STRING(val));
+	} else if (IS_BOOLEAN(val)) {
+		return AS_BOOLEAN(val) ? Js_true : Js_false;
 	} else if (IS_INTEGER(val)) {
-		return hiwire_int(AS_INTEGER(val));
+		return hiwire_number(AS_INTEGER(val), 1);
 	} else if (IS_FLOATING(val)) {
-		return hiwire_float(AS_FLOATING(val));
+		return hiwire_number(AS_FLOATING(val), 0);
 	} else if (IS_NONE(val)) {
 		return Js_undefined;
-	} else if (IS_list(val)) {
-		JsRef array = JsArray_New();
-		for (size_t i = 0; i < AS_LIST(val)->count; ++i) {
-			JsRef entry = fromKrk(AS_LIST(val)->values[i]);
-			if (entry == 0) {
-				hiwire_decref(array);
-				return 0; /* Inner exception raised */
-			}
-			JsArray_Push(array, entry);
-			hiwire_decref(entry);
-		}
-		return array;
+	} else if (IS_list(val) || IS_TUPLE(val) || IS_dict(val) || IS_BYTES(val) || IS_bytearray(val) ||
+			krk_isInstanceOf(val, vm.baseClasses->setClass)) {
+		return packToJs(val, 0);
 	} else if (IS_function(val) || IS_method(val)) {
 		return make_proxy(val);
 	} else {
@@ -472,6 +1577,59 @@ static JsRef fromKrk(KrkValue val) {
 	}
 }
 
+/**
+ * Encode a value into an argument vector entry. Numbers and strings are
+ * stored inline, JSObjects are borrowed, and anything else gets an owned
+ * ref from fromKrk. Returns 0 with an exception set on failure.
+ */
+static int toJsArg(KrkValue val, struct JsArg * arg) {
+	if (IS_BOOLEAN(val)) {
+		arg->type = JS_ARG_BORROWED;
+		arg->as.ref = AS_BOOLEAN(val) ? Js_true : Js_false;
+	} else if (IS_INTEGER(val)) {
+		arg->type = JS_ARG_NUMBER;
+		arg->as.number = AS_INTEGER(val);
+	} else if (IS_FLOATING(val)) {
+		arg->type = JS_ARG_NUMBER;
+		arg->as.number = AS_FLOATING(val);
+	} else if (IS_STRING(val)) {
+		int id = js_string_id(AS_STRING(val), 0);
+		if (id >= 0) {
+			arg->type = JS_ARG_CACHED;
+			arg->as.id = id;
+		} else {
+			arg->type = JS_ARG_STRING;
+			arg->length = AS_STRING(val)->length;
+			arg->as.chars = AS_CSTRING(val);
+		}
+	} else if (IS_JSObject(val)) {
+		arg->type = JS_ARG_BORROWED;
+		arg->as.ref = jsRef(AS_JSObject(val));
+	} else {
+		JsRef ref = fromKrk(val);
+		if (!ref) return 0;
+		arg->type = JS_ARG_REF;
+		arg->as.ref = ref;
+	}
+	return 1;
+}
+
+/**
+ * Encode argc values from argv into args, which must have room for them.
+ * On failure, owned refs encoded so far are released.
+ */
+static int toJsArgs(int argc, const KrkValue argv[], struct JsArg * args) {
+	for (int i = 0; i < argc; ++i) {
+		if (!toJsArg(argv[i], &args[i])) {
+			for (int j = 0; j < i; ++j) {
+				if (args[j].type == JS_ARG_REF) hiwire_decref(args[j].as.ref);
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
 KRK_StaticMethod(JSObject,__new__) {
 	if (argc == 1) {
 		return fromJs(hiwire_object(), 0);
@@ -485,12 +1643,11 @@ KRK_Method(JSObject,__repr__) {
 	pushStringBuilderStr(&sb, "<JSObject ", 10);
 
 	char asNumber[30];
-	snprintf(asNumber, 30, "id=%zu", (uintptr_t)self->js);
+	snprintf(asNumber, 30, "id=%zu", (uintptr_t)jsRef(self));
 	pushStringBuilderStr(&sb, asNumber, strlen(asNumber));
 
-	JsRef s = hiwire_to_string(self->js);
-	char * asString = hiwire_to_str(s);
-	krk_push(OBJECT_VAL(krk_takeString(asString,strlen(asString))));
+	JsRef s = hiwire_to_string(jsRef(self));
+	krk_push(stringFromJs(s));
 	hiwire_decref(s);
 
 	/* repr str */
@@ -507,9 +1664,8 @@ KRK_Method(JSObject,__repr__) {
 }
 
 KRK_Method(JSObject,__str__) {
-	JsRef s = hiwire_to_string(self->js);
-	char * asString = hiwire_to_str(s);
-	krk_push(OBJECT_VAL(krk_takeString(asString,strlen(asString))));
+	JsRef s = hiwire_to_string(jsRef(self));
+	krk_push(stringFromJs(s));
 	hiwire_decref(s);
 	return krk_pop();
 }
@@ -518,12 +1674,25 @@ KRK_Method(JSObject,__getattr__) {
 	METHOD_TAKES_EXACTLY(1);
 	if (!IS_STRING(argv[1])) return krk_runtimeError(vm.exceptions->typeError, "expected str");
 
-	JsRef val = obj_getattr(self->js, AS_CSTRING(argv[1]));
+	KrkString * name = AS_STRING(argv[1]);
+	JsRef val = obj_getmethod(jsRef(self), js_string_id(name, 1), name->chars, name->length);
 
 	if (val == 0) {
 		return krk_runtimeError(vm.exceptions->attributeError, "JSObject has no attribute '%s'", AS_CSTRING(argv[1]));
 	}
 
+	if (val == Js_novalue) {
+		/* A plain JS function; hand out a method that is resolved when called. */
+		if (self->method && self->method->name == name && !self->method->js) {
+			return OBJECT_VAL(self->method);
+		}
+		struct JSObject * method = (void*)krk_newInstance(JSObject);
+		method->name = name;
+		method->receiver = self;
+		self->method = method;
+		return OBJECT_VAL(method);
+	}
+
 	return fromJs(val,self->js);
 }
 
@@ -537,7 +1706,7 @@ KRK_Method(JSObject,__setattr__) {
 
 	JsRef val = fromKrk(argv[2]);
 	if (!val) return NONE_VAL();
-	obj_setattr(self->js, AS_CSTRING(argv[1]), val);
+	js_setattr(jsRef(self), AS_STRING(argv[1]), val);
 	hiwire_decref(val);
 	return argv[2];
 }
@@ -549,67 +1718,46 @@ KRK_Method(JSObject,__call__) {
 		return krk_runtimeError(vm.exceptions->typeError, "keyword arguments unsupported in call");
 	}
 
-	JsRef args = JsArray_New();
+	struct JsArg stackArgs[JS_ARGS_ON_STACK];
+	struct JsArg * args = argc - 1 <= JS_ARGS_ON_STACK ? stackArgs : malloc(sizeof(struct JsArg) * (argc - 1));
 
-	for (size_t i = 1; i < argc; ++i) {
-		if (IS_JSObject(argv[i])) {
-			JsArray_Push(args, AS_JSObject(argv[i])->js);
-		} else {
-			JsRef val = fromKrk(argv[i]);
-			if (!val) {
-				hiwire_decref(args);
-				return NONE_VAL();
-			}
-			JsArray_Push(args, val);
-			hiwire_decref(val);
-		}
+	if (!toJsArgs(argc - 1, &argv[1], args)) {
+		if (args != stackArgs) free(args);
+		return NONE_VAL();
 	}
 
-	JsRef result = obj_call(self->js, self->this, args);
-	hiwire_decref(args);
-
-	if (result == 0) {
-		JsRef    excp = hiwire_get_error();
-		JsRef    maybe_krk = obj_getattr(excp, "__krkval__");
-		if (maybe_krk) {
-			hiwire_decref(excp);
-			krk_currentThread.currentException = fromJs(maybe_krk,0);
-			krk_currentThread.flags |= KRK_THREAD_HAS_EXCEPTION;
-		} else {
-			JsRef name = obj_getattr(excp,"name");
-			JsRef msg  = obj_getattr(excp,"message");
-			hiwire_decref(excp);
-			char * _name, * _msg;
-
-			if (name) {
-				_name = hiwire_to_str(name);
-				hiwire_decref(name);
-			} else {
-				_name = strdup("(unnamed)");
-			}
+	JsRef result;
+	if (!self->js && self->name) {
+		result = obj_call_method(jsRef(self->receiver), js_string_id(self->name, 1),
+			self->name->chars, self->name->length, args, argc - 1);
+	} else {
+		result = obj_call(self->js, self->this, args, argc - 1);
+	}
+	if (args != stackArgs) free(args);
 
-			if (msg) {
-				_msg = hiwire_to_str(msg);
-				hiwire_decref(msg);
-			} else {
-				_msg = strdup("");
-			}
+	if (result == 0) return raiseJsException();
 
-			if (!strcmp(_name, "TypeError")) {
-				krk_runtimeError(vm.exceptions->typeError, "%s", _msg);
-			} else if (!strcmp(_name, "ReferenceError")) {
-				krk_runtimeError(vm.exceptions->nameError, "%s", _msg);
-			} else {
-				krk_runtimeError(vm.exceptions->valueError, "%s: %s", _name, _msg);
-			}
+	return fromJs(result,0);
+}
 
-			free(_name);
-			free(_msg);
-		}
-		return NONE_VAL();
+KRK_Method(JSObject,to_native) {
+	METHOD_TAKES_AT_MOST(1);
+	int maxDepth = JS_PACK_MAX_DEPTH;
+	if (argc > 1) {
+		if (!IS_INTEGER(argv[1])) return TYPE_ERROR(int,argv[1]);
+		maxDepth = AS_INTEGER(argv[1]);
 	}
+	return unpackFromJs(jsRef(self), maxDepth);
+}
 
-	return fromJs(result,0);
+KRK_Method(JSObject,to_bytes) {
+	METHOD_TAKES_NONE();
+	int length = hiwire_byte_length(jsRef(self));
+	if (length < 0) return krk_runtimeError(vm.exceptions->typeError, "JSObject is not an ArrayBuffer or TypedArray");
+	KrkBytes * bytes = krk_newBytes(length, NULL);
+	hiwire_copy_bytes(self->js, bytes->bytes);
+	krk_bytesUpdateHash(bytes);
+	return OBJECT_VAL(bytes);
 }
 
 FUNC_SIG(list,append);
@@ -621,7 +1769,7 @@ KRK_Method(JSObject,__dir__) {
 	KrkValue myList = krk_dirObject(1,argv,0);
 	krk_push(myList);
 
-	JsRef results = obj_dir(self->js);
+	JsRef results = obj_dir(jsRef(self));
 
 	int i = 0;
 	do {
@@ -645,38 +1793,275 @@ KRK_Method(JSObject,__getitem__) {
 
 	JsRef key = fromKrk(argv[1]);
 	if (!key) return NONE_VAL();
-	JsRef val = obj_getitem(self->js, key);
+	JsRef val = obj_getitem(jsRef(self), key);
 	hiwire_decref(key);
 	return fromJs(val,0);
 }
 
-EMSCRIPTEN_KEEPALIVE int krk_cleanup(int index) {
-	KrkValue id = INTEGER_VAL(index);
-	KrkValue objList;
-	if (krk_tableGet(AS_DICT(_objects), id, &objList)) {
-		int count = AS_INTEGER(AS_LIST(objList)->values[1]);
-		if (count == 1) {
-			KrkValue val   = AS_LIST(objList)->values[0];
-			krk_tableDelete(AS_DICT(_objects), id);
-			krk_tableDelete(AS_DICT(_objToId), val);
-		} else {
-			AS_LIST(objList)->values[1] = INTEGER_VAL(count-1);
+KRK_Method(JSObject,__len__) {
+	METHOD_TAKES_NONE();
+	int length = obj_length(jsRef(self));
+	if (length < 0) return krk_runtimeError(vm.exceptions->typeError, "JSObject has no length");
+	return INTEGER_VAL(length);
+}
+
+KRK_Method(JSObject,__iter__) {
+	METHOD_TAKES_NONE();
+	JsRef iter = obj_iter(jsRef(self));
+	if (!iter) return krk_runtimeError(vm.exceptions->typeError, "JSObject is not iterable");
+	struct JSIterator * out = (void*)krk_newInstance(JSIterator);
+	out->iter = iter;
+	return OBJECT_VAL(out);
+}
+
+#undef CURRENT_CTYPE
+#define CURRENT_CTYPE struct JSIterator *
+#define IS_JSIterator(o) (krk_isInstanceOf(o, JSIterator))
+#define AS_JSIterator(o) ((struct JSIterator*)AS_OBJECT(o))
+
+static void _jsiterator_ongcscan(KrkInstance * self) {
+	struct JSIterator * _self = (void*)self;
+	for (int i = _self->index; i < _self->count; ++i) {
+		krk_markValue(_self->buffer[i]);
+	}
+}
+
+static void _jsiterator_ongcsweep(KrkInstance * self) {
+	struct JSIterator * _self = (void*)self;
+	if (_self->iter) {
+		hiwire_decref(_self->iter);
+		_self->iter = 0;
+	}
+}
+
+KRK_Method(JSIterator,__iter__) {
+	return argv[0];
+}
+
+KRK_Method(JSIterator,__call__) {
+	if (self->index == self->count) {
+		if (self->done) return argv[0];
+		self->index = self->count = 0;
+		struct JsArg frame[JS_ITER_BATCH];
+		int count = obj_iter_fill(self->iter, frame, JS_ITER_BATCH);
+		int failed = count < 0;
+		if (failed) count = -count - 1;
+		/* Decoding takes ownership of every entry, so finish it even on failure */
+		for (int i = 0; i < count; ++i) {
+			self->buffer[i] = fromJsArg(&frame[i]);
+			self->count = i + 1;
 		}
+		if (failed) {
+			self->done = 1;
+			self->count = 0;
+			return raiseJsException();
+		}
+		if (count < JS_ITER_BATCH) self->done = 1;
+		if (!count) return argv[0];
 	}
+	return self->buffer[self->index++];
+}
+
+/**
+ * A batch records DOM operations into a command buffer and applies them
+ * all in one crossing on flush(). Nodes created by the batch are
+ * referred to by the index create() returns; node(i) fetches one after
+ * it has been flushed.
+ */
+struct JSBatch {
+	KrkInstance inst;
+	struct JsPacker commands;
+	KrkValue keep;     /* JSObjects referenced by pending commands */
+	uint32_t created;  /* Nodes created, flushed or not */
+	uint32_t flushed;  /* Nodes created by earlier flushes */
+	JsRef state;
+};
+
+#undef CURRENT_CTYPE
+#define CURRENT_CTYPE struct JSBatch *
+#define IS_JSBatch(o) (krk_isInstanceOf(o, JSBatch))
+#define AS_JSBatch(o) ((struct JSBatch*)AS_OBJECT(o))
+
+static void _jsbatch_ongcscan(KrkInstance * self) {
+	krk_markValue(((struct JSBatch*)self)->keep);
+}
+
+static void _jsbatch_release(struct JSBatch * self) {
+	for (size_t i = 0; i < self->commands.refCount; ++i) hiwire_decref(self->commands.refs[i]);
+	self->commands.refCount = 0;
+	self->commands.length = 0;
+	if (IS_list(self->keep)) AS_LIST(self->keep)->count = 0;
+}
 
+static void _jsbatch_ongcsweep(KrkInstance * self) {
+	struct JSBatch * _self = (void*)self;
+	_jsbatch_release(_self);
+	free(_self->commands.data);
+	free(_self->commands.refs);
+	_self->commands.data = NULL;
+	_self->commands.refs = NULL;
+	if (_self->state) {
+		hiwire_decref(_self->state);
+		_self->state = 0;
+	}
+}
+
+static int batch_node_operand(struct JSBatch * self, KrkValue node) {
+	if (IS_INTEGER(node) && !IS_BOOLEAN(node)) {
+		if (AS_INTEGER(node) < 0 || (uint64_t)AS_INTEGER(node) >= self->created) {
+			krk_runtimeError(vm.exceptions->indexError, "no node %d in this batch", (int)AS_INTEGER(node));
+			return 0;
+		}
+		*pack_reserve(&self->commands, 1) = 0;
+		pack_u32(&self->commands, AS_INTEGER(node));
+		return 1;
+	} else if (IS_JSObject(node)) {
+		krk_writeValueArray(AS_LIST(self->keep), node);
+		*pack_reserve(&self->commands, 1) = 1;
+		pack_u32(&self->commands, (uintptr_t)jsRef(AS_JSObject(node)));
+		return 1;
+	}
+	krk_runtimeError(vm.exceptions->typeError, "expected a JSObject or a node index, not '%T'", node);
+	return 0;
+}
+
+static void batch_string(struct JSBatch * self, KrkString * str) {
+	pack_bytes(&self->commands, JS_PACK_STRING, str->chars, str->length);
+}
+
+/* Drop a partially written command */
+static KrkValue batch_abort(struct JSBatch * self, size_t length, size_t refCount) {
+	for (size_t i = refCount; i < self->commands.refCount; ++i) hiwire_decref(self->commands.refs[i]);
+	self->commands.refCount = refCount;
+	self->commands.length = length;
+	return NONE_VAL();
+}
+
+KRK_Method(JSBatch,create) {
+	METHOD_TAKES_EXACTLY(1);
+	CHECK_ARG(1,str,KrkString*,tag);
+	pack_tag(&self->commands, JS_BATCH_CREATE);
+	batch_string(self, tag);
+	return INTEGER_VAL(self->created++);
+}
+
+static KrkValue batch_node_string(struct JSBatch * self, enum JsBatchOp op, KrkValue node, KrkValue str) {
+	if (!IS_STRING(str)) return TYPE_ERROR(str,str);
+	size_t length = self->commands.length;
+	size_t refCount = self->commands.refCount;
+	pack_tag(&self->commands, op);
+	if (!batch_node_operand(self, node)) return batch_abort(self, length, refCount);
+	batch_string(self, AS_STRING(str));
+	return NONE_VAL();
+}
+
+KRK_Method(JSBatch,text) {
+	METHOD_TAKES_EXACTLY(2);
+	return batch_node_string(self, JS_BATCH_TEXT, argv[1], argv[2]);
+}
+
+KRK_Method(JSBatch,html) {
+	METHOD_TAKES_EXACTLY(2);
+	return batch_node_string(self, JS_BATCH_HTML, argv[1], argv[2]);
+}
+
+static KrkValue batch_property(struct JSBatch * self, enum JsBatchOp op, KrkValue node, KrkValue name, KrkValue value) {
+	if (!IS_STRING(name)) return TYPE_ERROR(str,name);
+	size_t length = self->commands.length;
+	size_t refCount = self->commands.refCount;
+	pack_tag(&self->commands, op);
+	if (!batch_node_operand(self, node)) return batch_abort(self, length, refCount);
+	batch_string(self, AS_STRING(name));
+	if (!pack_value(&self->commands, value)) return batch_abort(self, length, refCount);
+	return NONE_VAL();
+}
+
+KRK_Method(JSBatch,set) {
+	METHOD_TAKES_EXACTLY(3);
+	return batch_property(self, JS_BATCH_SET, argv[1], argv[2], argv[3]);
+}
+
+KRK_Method(JSBatch,attr) {
+	METHOD_TAKES_EXACTLY(3);
+	if (!IS_STRING(argv[3])) return TYPE_ERROR(str,argv[3]);
+	return batch_property(self, JS_BATCH_ATTR, argv[1], argv[2], argv[3]);
+}
+
+KRK_Method(JSBatch,append) {
+	METHOD_TAKES_EXACTLY(2);
+	size_t length = self->commands.length;
+	size_t refCount = self->commands.refCount;
+	pack_tag(&self->commands, JS_BATCH_APPEND);
+	if (!batch_node_operand(self, argv[1]) || !batch_node_operand(self, argv[2])) return batch_abort(self, length, refCount);
+	return NONE_VAL();
+}
+
+KRK_Method(JSBatch,flush) {
+	METHOD_TAKES_NONE();
+	if (!self->commands.length) return NONE_VAL();
+	if (!self->state) self->state = batch_new_state();
+	/* References in the buffer are borrowed by the replay, and released here even if it fails */
+	JsRef result = batch_replay(self->state, self->commands.data, self->commands.length);
+	_jsbatch_release(self);
+	if (!result) {
+		/* The replay dropped the nodes it made; so do we */
+		self->created = self->flushed;
+		return raiseJsException();
+	}
+	self->flushed = self->created;
+	return NONE_VAL();
+}
+
+KRK_Method(JSBatch,node) {
+	METHOD_TAKES_EXACTLY(1);
+	CHECK_ARG(1,int,krk_integer_type,index);
+	if (index < 0 || (uint64_t)index >= self->flushed) {
+		return krk_runtimeError(vm.exceptions->indexError, "node %d has not been flushed", (int)index);
+	}
+	return fromJs(batch_node(self->state, index), 0);
+}
+
+KRK_Method(JSBatch,__enter__) {
+	METHOD_TAKES_NONE();
+	return argv[0];
+}
+
+KRK_Method(JSBatch,__exit__) {
+	/* Leave the commands unapplied if the block raised */
+	if (argc > 1 && !IS_NONE(argv[1])) {
+		_jsbatch_release(self);
+		self->created = self->flushed;
+		return NONE_VAL();
+	}
+	return FUNC_NAME(JSBatch,flush)(1, argv, 0);
+}
+
+#undef CURRENT_CTYPE
+#define CURRENT_CTYPE struct JSObject *
+
+/**
+ * How many calls from JS into Kuroko are running. A time slice can only
+ * yield when there are no JS frames between it and krk_call (wasmmain.c).
+ */
+int js_reentry = 0;
+
+EMSCRIPTEN_KEEPALIVE int krk_cleanup(int index) {
+	if (index < 0) pin_release(-1 - index);
+	else proxy_release(index);
 	return 0;
 }
 
 EMSCRIPTEN_KEEPALIVE JsRef krk_call_args(int krkindex, JsRef jsargsindex) {
 	int num_args = hiwire_args_count(jsargsindex);
-	KrkValue id = INTEGER_VAL(krkindex);
-	KrkValue objList;
-	if (krk_tableGet(AS_DICT(_objects), id, &objList)) {
-		krk_push(AS_LIST(objList)->values[0]);
+	KrkValue value;
+	if (proxy_get(krkindex, &value)) {
+		krk_push(value);
 		for (int i = 0; i < num_args; ++i) {
 			krk_push(fromJs(hiwire_args_get(jsargsindex, i), 0));
 		}
+		js_reentry++;
 		KrkValue result = krk_callStack(num_args);
+		js_reentry--;
 		if (unlikely(krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION)) {
 			return 0;
 		}
@@ -686,6 +2071,37 @@ EMSCRIPTEN_KEEPALIVE JsRef krk_call_args(int krkindex, JsRef jsargsindex) {
 	return 0;
 }
 
+/**
+ * Fast path for JS calling a proxied Kuroko callable: arguments arrive
+ * in js_callframe and the result is written back to its first entry.
+ * The arguments are copied off the frame before anything else runs, so
+ * a nested call that reuses the frame can't overwrite them.
+ */
+EMSCRIPTEN_KEEPALIVE int krk_call_frame(int krkindex, int argc) {
+	struct JsArg args[JS_CALLFRAME_SIZE];
+	memcpy(args, js_callframe, sizeof(struct JsArg) * argc);
+	KrkValue value;
+	if (!proxy_get(krkindex, &value)) {
+		for (int i = 0; i < argc; ++i) {
+			if (args[i].type == JS_ARG_REF) hiwire_decref(args[i].as.ref);
+			else if (args[i].type == JS_ARG_STRING) free((char*)args[i].as.chars);
+		}
+		krk_runtimeError(vm.exceptions->typeError, "invalid object?\n");
+		return 0;
+	}
+	krk_push(value);
+	for (int i = 0; i < argc; ++i) {
+		krk_push(fromJsArg(&args[i]));
+	}
+	js_reentry++;
+	KrkValue result = krk_callStack(argc);
+	js_reentry--;
+	if (unlikely(krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION)) {
+		return 0;
+	}
+	return toJsArg(result, &js_callframe[0]);
+}
+
 EMSCRIPTEN_KEEPALIVE JsRef krk_get_currentException(void) {
 	/* Unset exception */
 	krk_currentThread.flags &= ~(KRK_THREAD_HAS_EXCEPTION);
@@ -700,7 +2116,7 @@ EMSCRIPTEN_KEEPALIVE JsRef krk_get_currentException(void) {
 		result = krk_callDirect(type->_tostr, 1);
 	}
 	JsRef arr  = JsArray_New();
-	JsRef desc = hiwire_string_utf8(IS_STRING(result) ? AS_CSTRING(result): "(unrepresentable)");
+	JsRef desc = js_string(IS_STRING(result) ? AS_STRING(result) : S("(unrepresentable)"));
 	JsArray_Push(arr, desc);
 	hiwire_decref(desc);
 	JsRef excp = make_proxy(krk_currentThread.currentException);
@@ -719,38 +2135,342 @@ EMSCRIPTEN_KEEPALIVE JsRef krk_get_currentException(void) {
  * Emscripten boilerplate will probably log a bunch of errors,
  * but it should still work.
  */
+/**
+ * When cross-origin isolated, each worker gets a control block in shared
+ * memory; its layout is described in workerWrapper.js. Workers send output
+ * in chunks of lines and hold back once too much is unacknowledged. For
+ * jobs run with the 'a' flag, the worker also sleeps in Atomics.wait for
+ * debugger commands and input lines instead of polling for messages.
+ */
+EM_JS(void, worker_setup_shared, (int worker), {
+	if (typeof SharedArrayBuffer === 'undefined' || !self.crossOriginIsolated) return;
+	let info = Browser.workers[worker];
+	let buffer = new SharedArrayBuffer(24 + 65536);
+	info.control = {
+		i32: new Int32Array(buffer, 0, 4),
+		f64: new Float64Array(buffer, 16, 1),
+		u8: new Uint8Array(buffer, 24),
+		blocking: false,
+	};
+	info.worker.postMessage({ control: buffer });
+});
+
+/* Called as each job starts, as pooled workers run more than one */
+EM_JS(void, worker_start_job, (int worker, int blocking), {
+	let info = Browser.workers[worker];
+	info.waitingForInput = false;
+	if (info.control) info.control.blocking = !!blocking;
+});
+
+/* Without a control block the worker paces its output by time instead */
+EM_JS(void, worker_ack_output, (int worker, int size), {
+	let info = Browser.workers[worker];
+	if (!info || !info.control) return;
+	Atomics.add(info.control.i32, 1, size);
+	Atomics.notify(info.control.i32, 1);
+});
+
+EM_JS(void, worker_input_requested, (int worker), {
+	let info = Browser.workers[worker];
+	if (info) info.waitingForInput = true;
+});
+
+EM_JS(void, worker_send, (int worker, const char * ptr, size_t len), {
+	let info = Browser.workers[worker];
+	if (!info) return;
+	let message = Hiwire.decode(ptr, len);
+	let sentAt = performance.timeOrigin + performance.now();
+	if (!info.control || !info.control.blocking) {
+		info.worker.postMessage({ command: message, sentAt: sentAt });
+		return;
+	}
+	let status;
+	if (info.waitingForInput) {
+		info.waitingForInput = false;
+		let bytes = new TextEncoder().encode(message).subarray(0, info.control.u8.length);
+		info.control.u8.set(bytes);
+		Atomics.store(info.control.i32, 2, bytes.length);
+		status = 1;
+	} else {
+		status = { continue: 1, traceback: 2, step: 3, quit: 4 }[message];
+		if (!status) return;
+	}
+	info.control.f64[0] = sentAt;
+	Atomics.store(info.control.i32, 0, status);
+	Atomics.notify(info.control.i32, 0);
+});
+
+/**
+ * kuroko-jspi.js is the same worker built with JS Promise Integration
+ * instead of Asyncify (see the Makefile); use it if the browser can,
+ * unless Module.workerJspi is false, which benchmarks use to compare.
+ */
+EM_JS(int, worker_has_jspi, (), {
+	return Module.workerJspi !== false && typeof WebAssembly.Suspending === 'function';
+});
+
+/* Hand the worker its compiled wasm module from the page's cache (base.js) */
+EM_JS(void, worker_post_module, (int worker, const char * url), {
+	let info = Browser.workers[worker];
+	let wasmUrl = UTF8ToString(url).replace(/[.]js$/, '.wasm');
+	if (typeof compileWasm !== 'function') {
+		info.worker.postMessage({ wasmModule: null });
+		return;
+	}
+	compileWasm(wasmUrl).then(function (module) {
+		info.worker.postMessage({ wasmModule: module });
+	}).catch(function () {
+		info.worker.postMessage({ wasmModule: null });
+	});
+});
+
+/**
+ * Workers send the files each job changed as a message of their own
+ * (see _fsSendChanges in workerWrapper.js), ahead of the job's result.
+ * Apply them here, with _fsApply from fsChanges.js, and pass them on to
+ * every other worker.
+ */
+EM_JS(void, worker_setup_fs, (int worker), {
+	Browser.workers[worker].worker.addEventListener('message', function (e) {
+		if (!e.data || !e.data.fsChanges) return;
+		_fsApply(e.data.fsChanges);
+		for (let id in Browser.workers) {
+			if (id != worker && Browser.workers[id]) Browser.workers[id].worker.postMessage({ fsChanges: e.data.fsChanges });
+		}
+	});
+});
+
+static worker_handle create_worker(const char * url) {
+	char variant[1024];
+	size_t urlLength = strlen(url);
+	if (urlLength >= 9 && !strcmp(url + urlLength - 9, "kuroko.js") && urlLength < sizeof(variant) - 5 && worker_has_jspi()) {
+		snprintf(variant, sizeof(variant), "%.*skuroko-jspi.js", (int)(urlLength - 9), url);
+		url = variant;
+	}
+	worker_handle out = emscripten_create_worker(url);
+	worker_post_module(out, url);
+	worker_setup_shared(out);
+	worker_setup_fs(out);
+	return out;
+}
+
+/**
+ * Pool of warm workers for run_worker. Pooled workers are created ahead of
+ * time and asked to set up their VM (krk_warm_worker); a job given to a
+ * worker that is still warming waits in its message queue. Workers go
+ * back to the pool when their job's final result comes in. When every
+ * pooled worker is busy, run_worker starts a cold one as before.
+ */
+#define WORKER_POOL_MAX 16
+
+enum { POOL_WARMING, POOL_IDLE, POOL_BUSY };
+
+static struct PoolWorker {
+	worker_handle id;
+	int state;
+	int queued;       /* A job was given to it while it was warming */
+	double spawnedAt;
+} workerPool[WORKER_POOL_MAX];
+
+static struct {
+	char url[1024];
+	int size;
+	int count;
+	int coldStarts;   /* Jobs that found no pooled worker free */
+	int spawned;
+	double spawnTotal;
+	double spawnLast;
+} poolInfo;
+
+static void _jsworker_callback(char * data, int size, void * arg);
+
+static int pool_find(worker_handle id) {
+	for (int i = 0; i < poolInfo.count; ++i) {
+		if (workerPool[i].id == id) return i;
+	}
+	return -1;
+}
+
+static void pool_remove(int i) {
+	workerPool[i] = workerPool[--poolInfo.count];
+}
+
+static void pool_fill(void) {
+	while (poolInfo.count < poolInfo.size) {
+		struct PoolWorker * entry = &workerPool[poolInfo.count++];
+		entry->spawnedAt = emscripten_get_now();
+		entry->id = create_worker(poolInfo.url);
+		entry->state = POOL_WARMING;
+		entry->queued = 0;
+		emscripten_call_worker(entry->id, "krk_warm_worker", NULL, 0, _jsworker_callback, (void*)(intptr_t)entry->id);
+	}
+}
+
+/* Find a free pooled worker for url, preferring one that is already warm */
+static worker_handle pool_take(const char * url) {
+	if (!poolInfo.size || strcmp(url, poolInfo.url)) return -1;
+	for (int i = 0; i < poolInfo.count; ++i) {
+		if (workerPool[i].state == POOL_IDLE) {
+			workerPool[i].state = POOL_BUSY;
+			return workerPool[i].id;
+		}
+	}
+	for (int i = 0; i < poolInfo.count; ++i) {
+		if (workerPool[i].state == POOL_WARMING && !workerPool[i].queued) {
+			workerPool[i].queued = 1;
+			return workerPool[i].id;
+		}
+	}
+	poolInfo.coldStarts++;
+	return -1;
+}
+
+static void pool_warmed(worker_handle id) {
+	int i = pool_find(id);
+	if (i < 0) return;
+	poolInfo.spawnLast = emscripten_get_now() - workerPool[i].spawnedAt;
+	poolInfo.spawnTotal += poolInfo.spawnLast;
+	poolInfo.spawned++;
+	workerPool[i].state = workerPool[i].queued ? POOL_BUSY : POOL_IDLE;
+	workerPool[i].queued = 0;
+}
+
+static void pool_release(worker_handle id) {
+	int i = pool_find(id);
+	if (i < 0 || workerPool[i].state != POOL_BUSY) return;
+	workerPool[i].state = POOL_IDLE;
+}
+
+/* Workers dropped from the pool mid-job, destroyed when the job finishes */
+static worker_handle * retiring = NULL;
+static int retiringCount = 0;
+static int retiringSpace = 0;
+
+static void pool_retire(worker_handle id) {
+	if (retiringCount == retiringSpace) {
+		retiringSpace = retiringSpace ? retiringSpace * 2 : 8;
+		retiring = realloc(retiring, sizeof(worker_handle) * retiringSpace);
+	}
+	retiring[retiringCount++] = id;
+}
+
+/* Stop waiting to destroy a worker; returns whether it was waiting */
+static int pool_unretire(worker_handle id) {
+	for (int i = 0; i < retiringCount; ++i) {
+		if (retiring[i] == id) {
+			retiring[i] = retiring[--retiringCount];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Worker messages that run Kuroko code or touch its heap wait while a
+ * sliced krk_call is suspended (wasmmain.c), so they can't interleave
+ * with it; wasmmain.c calls js_run_deferred_later when the run finishes.
+ * Output and warm-up messages don't, and are handled right away. Calls
+ * into Kuroko from JS event handlers need their result at once, so they
+ * can't wait; they run inside the pause, as calls from native code do,
+ * and can't yield themselves.
+ */
+extern int krk_slice_suspended(void);
+
+struct DeferredMessage {
+	struct DeferredMessage * next;
+	int worker;
+	int size;
+	char data[];
+};
+
+static struct DeferredMessage * deferredHead = NULL;
+static struct DeferredMessage ** deferredTail = &deferredHead;
+
+static void worker_message(char * data, int size, int worker);
+
+static void js_run_deferred(void * unused) {
+	while (deferredHead && !krk_slice_suspended()) {
+		struct DeferredMessage * message = deferredHead;
+		deferredHead = message->next;
+		if (!deferredHead) deferredTail = &deferredHead;
+		worker_message(message->data, message->size, message->worker);
+		free(message);
+	}
+}
+
+void js_run_deferred_later(void) {
+	if (deferredHead) emscripten_async_call(js_run_deferred, NULL, 0);
+}
+
 static void _jsworker_callback(char * data, int size, void * arg) {
+	int worker = (intptr_t)arg;
+	int immediate = size > 0 && (data[0] == 'O' || data[0] == 'E' || data[0] == 'w');
+	if (!immediate && (deferredHead || krk_slice_suspended())) {
+		struct DeferredMessage * message = malloc(sizeof(struct DeferredMessage) + (size > 0 ? size : 0));
+		message->next = NULL;
+		message->worker = worker;
+		message->size = size;
+		if (size > 0) memcpy(message->data, data, size);
+		*deferredTail = message;
+		deferredTail = &message->next;
+		return;
+	}
+	worker_message(data, size, worker);
+}
+
+static void worker_message(char * data, int size, int worker) {
 	/* Is this the final result? */
 	if (size > 0 && data[0] == 'x') {
-		KrkObj * callback = arg;
-		krk_push(OBJECT_VAL(callback));
-
-		/* Figure out what to do with it. */
-		if (data[1] == 'S') {
-			krk_push(OBJECT_VAL(krk_copyString(data+2,size-2)));
-		} else if (data[1] == 'I') {
-			int x = atoi(&data[2]);
-			krk_push(INTEGER_VAL(x));
-		} else if (data[1] == 'N') {
-			krk_push(NONE_VAL());
-		}
-		krk_callValue(OBJECT_VAL(callback), 1, 1);
-		krk_runNext();
+		/* Free the worker first so the callback can start another job on it */
+		pool_release(worker);
+		char name[64];
+		snprintf(name, sizeof(name), "__worker_%d_data", worker);
+		KrkValue callback;
+		if (krk_tableGet(&jsModule->fields, OBJECT_VAL(krk_copyString(name,strlen(name))), &callback)) {
+			krk_push(callback);
+
+			/* Figure out what to do with it. */
+			if (data[1] == 'S') {
+				krk_push(OBJECT_VAL(krk_copyString(data+2,size-2)));
+			} else if (data[1] == 'I') {
+				int x = atoi(&data[2]);
+				krk_push(INTEGER_VAL(x));
+			} else if (data[1] == 'N') {
+				krk_push(NONE_VAL());
+			}
+			krk_callValue(callback, 1, 1);
+			krk_runNext();
+		}
+		/* Left the pool while it was busy, and the callback didn't destroy it */
+		if (pool_unretire(worker)) emscripten_destroy_worker(worker);
+	} else if (size > 0 && data[0] == 'w') {
+		pool_warmed(worker);
+	} else if (size > 0 && data[0] == 'q') {
+		/* Stats for the job, see send_stats in worker.c */
+		unsigned long long instructions = 0;
+		unsigned long heapGrowth = 0;
+		double ms = 0;
+		char exceeded[32] = "-";
+		sscanf(data + 1, "%llu %lf %lu %31s", &instructions, &ms, &heapGrowth, exceeded);
+		KrkValue stats = krk_dict_of(0,NULL,0);
+		krk_push(stats);
+		krk_tableSet(AS_DICT(stats), OBJECT_VAL(S("instructions")), INTEGER_VAL(instructions));
+		krk_tableSet(AS_DICT(stats), OBJECT_VAL(S("seconds")), FLOATING_VAL(ms / 1000.0));
+		krk_tableSet(AS_DICT(stats), OBJECT_VAL(S("memory")), INTEGER_VAL(heapGrowth));
+		krk_tableSet(AS_DICT(stats), OBJECT_VAL(S("exceeded")),
+			strcmp(exceeded, "-") ? OBJECT_VAL(krk_copyString(exceeded,strlen(exceeded))) : NONE_VAL());
+		char name[64];
+		snprintf(name, sizeof(name), "__worker_%d_stats", worker);
+		krk_attachNamedValue(&jsModule->fields, name, stats);
+		krk_pop();
 	} else if (size > 0 && data[0] == 'O') {
 		fputs(data+1,stdout);
 		fputs("\n",stdout);
+		worker_ack_output(worker, size);
 	} else if (size > 0 && data[0] == 'E') {
 		fputs(data+1,stderr);
 		fputs("\n",stderr);
-	} else if (size > 0 && data[0] == 'F') {
-		/* filesystem sync is completed, pull in changes */
-		EM_ASM(
-			window.setTimeout(function () {
-				FS.syncfs(true,function (err) {
-					if (err) { console.log(err); }
-				});
-			},200);
-		);
+		worker_ack_output(worker, size);
 	} else if (size > 0 && data[0] == 'd') {
 		KrkValue emModule = NONE_VAL();
 		krk_tableGet(&vm.modules,OBJECT_VAL(S("emscripten")),&emModule);
@@ -763,6 +2483,7 @@ static void _jsworker_callback(char * data, int size, void * arg) {
 		krk_callStack(1);
 	} else if (size > 0 && data[0] == 'i') {
 		/* Input request */
+		worker_input_requested(worker);
 		KrkValue emModule = NONE_VAL();
 		krk_tableGet(&vm.modules,OBJECT_VAL(S("emscripten")),&emModule);
 		if (!IS_INSTANCE(emModule)) return;
@@ -775,6 +2496,11 @@ static void _jsworker_callback(char * data, int size, void * arg) {
 	}
 }
 
+/**
+ * Start a job on a worker. Keyword arguments `instructions`, `seconds` and
+ * `memory` (bytes of heap growth) limit the job; see quota.h. Stats for
+ * the job are available from worker_run_stats() once its result is in.
+ */
 KRK_Function(run_worker) {
 	FUNCTION_TAKES_EXACTLY(4);
 	CHECK_ARG(0,str,KrkString*,_url);
@@ -782,6 +2508,18 @@ KRK_Function(run_worker) {
 	CHECK_ARG(2,OBJECT,KrkObj*,callback);
 	CHECK_ARG(3,str,KrkString*,_flags);
 
+	double limits[3] = {0,0,0};
+	if (hasKw) {
+		static const char * names[3] = {"instructions","seconds","memory"};
+		for (int i = 0; i < 3; ++i) {
+			KrkValue limit;
+			if (!krk_tableGet(AS_DICT(argv[argc]), OBJECT_VAL(krk_copyString(names[i],strlen(names[i]))), &limit)) continue;
+			if (IS_INTEGER(limit)) limits[i] = AS_INTEGER(limit);
+			else if (IS_FLOATING(limit)) limits[i] = AS_FLOATING(limit);
+			else return TYPE_ERROR(int or float,limit);
+		}
+	}
+
 	char * url   = _url->chars;
 	char * arg   = _arg->chars;
 	char * flags = _flags->chars;
@@ -789,12 +2527,17 @@ KRK_Function(run_worker) {
 	char tmp[1024];
 	getcwd(tmp,1024);
 
-	size_t finalSize = strlen(tmp) + 1 + strlen(flags) + 1 + strlen(arg) + 1;
+	char quota[100];
+	snprintf(quota, sizeof(quota), "%.0f %.3f %.0f", limits[0], limits[1] * 1000.0, limits[2]);
+
+	size_t finalSize = strlen(tmp) + 1 + strlen(flags) + 1 + strlen(quota) + 1 + strlen(arg) + 1;
 	char * finalArg = malloc(finalSize);
-	snprintf(finalArg, finalSize, "%s%c%s%c%s", tmp, '\0', flags, '\0', arg);
+	snprintf(finalArg, finalSize, "%s%c%s%c%s%c%s", tmp, '\0', flags, '\0', quota, '\0', arg);
 
-	worker_handle myWorker = emscripten_create_worker(url);
-	emscripten_call_worker(myWorker, "krk_run_worker", finalArg, finalSize, _jsworker_callback, callback);
+	worker_handle myWorker = pool_take(url);
+	if (myWorker < 0) myWorker = create_worker(url);
+	worker_start_job(myWorker, strchr(flags, 'a') != NULL);
+	emscripten_call_worker(myWorker, "krk_run_worker", finalArg, finalSize, _jsworker_callback, (void*)(intptr_t)myWorker);
 
 	{
 		char tmp[1024];
@@ -805,13 +2548,154 @@ KRK_Function(run_worker) {
 	return INTEGER_VAL(myWorker);
 }
 
+KRK_Function(to_js) {
+	FUNCTION_TAKES_AT_LEAST(1);
+	FUNCTION_TAKES_AT_MOST(2);
+	int typed = argc > 1 && !krk_isFalsey(argv[1]);
+	if (hasKw) {
+		KrkValue typedArg;
+		if (krk_tableGet(AS_DICT(argv[argc]), OBJECT_VAL(S("typed")), &typedArg)) {
+			typed = !krk_isFalsey(typedArg);
+		}
+	}
+	JsRef out = packToJs(argv[0], typed);
+	if (!out) return NONE_VAL();
+	return fromJs(out, 0);
+}
+
+KRK_Function(to_kuroko) {
+	FUNCTION_TAKES_AT_LEAST(1);
+	FUNCTION_TAKES_AT_MOST(2);
+	if (!IS_JSObject(argv[0])) return argv[0];
+	int maxDepth = JS_PACK_MAX_DEPTH;
+	if (argc > 1) {
+		if (!IS_INTEGER(argv[1])) return TYPE_ERROR(int,argv[1]);
+		maxDepth = AS_INTEGER(argv[1]);
+	}
+	return unpackFromJs(jsRef(AS_JSObject(argv[0])), maxDepth);
+}
+
+/**
+ * Expose a bytearray to JS as a Uint8Array sharing its storage, which is
+ * pinned until the view is collected. Resizing the bytearray invalidates
+ * the view: it may be left over freed memory, so take a new one after.
+ * bytes are immutable and may already be hashed, so they get a copy.
+ */
+KRK_Function(view) {
+	FUNCTION_TAKES_EXACTLY(1);
+	if (IS_BYTES(argv[0])) {
+		return fromJs(hiwire_bytes_copy(AS_BYTES(argv[0])->bytes, AS_BYTES(argv[0])->length), 0);
+	} else if (!IS_bytearray(argv[0])) {
+		return TYPE_ERROR(bytes or bytearray,argv[0]);
+	}
+	KrkValue storage = AS_bytearray(argv[0])->actual;
+	JsRef out = hiwire_bytes_view(AS_BYTES(storage)->bytes, AS_BYTES(storage)->length, slot_take(pins, storage));
+	return fromJs(out, 0);
+}
+
+KRK_Function(batch) {
+	FUNCTION_TAKES_NONE();
+	struct JSBatch * out = (void*)krk_newInstance(JSBatch);
+	krk_push(OBJECT_VAL(out));
+	out->keep = krk_list_of(0,NULL,0);
+	return krk_pop();
+}
+
+/**
+ * Send a debugger command ('continue', 'step', 'traceback', 'quit') or,
+ * while the worker is waiting in input(), a line of input.
+ */
+KRK_Function(send_worker) {
+	FUNCTION_TAKES_EXACTLY(2);
+	CHECK_ARG(0,int,krk_integer_type,workerId);
+	CHECK_ARG(1,str,KrkString*,message);
+	worker_send(workerId, message->chars, message->length);
+	return NONE_VAL();
+}
+
+KRK_Function(worker_run_stats) {
+	FUNCTION_TAKES_EXACTLY(1);
+	CHECK_ARG(0,int,krk_integer_type,workerId);
+	char name[64];
+	snprintf(name, sizeof(name), "__worker_%d_stats", (int)workerId);
+	KrkValue stats = NONE_VAL();
+	krk_tableGet(&jsModule->fields, OBJECT_VAL(krk_copyString(name,strlen(name))), &stats);
+	return stats;
+}
+
 KRK_Function(destroy_worker) {
 	FUNCTION_TAKES_EXACTLY(1);
 	CHECK_ARG(0,int,krk_integer_type,workerId);
 	emscripten_destroy_worker(workerId);
+	pool_unretire(workerId);
+	int i = pool_find(workerId);
+	if (i >= 0) {
+		pool_remove(i);
+		pool_fill();
+	}
 	return NONE_VAL();
 }
 
+/**
+ * Keep `size` warm workers for run_worker calls with this url. Idle
+ * workers beyond a smaller size are destroyed; busy ones, and warming
+ * ones with a job queued, are destroyed once that job's final result
+ * comes in. A size of 0 turns the pool off.
+ */
+KRK_Function(worker_pool) {
+	FUNCTION_TAKES_EXACTLY(2);
+	CHECK_ARG(0,str,KrkString*,url);
+	CHECK_ARG(1,int,krk_integer_type,size);
+	if (size < 0 || size > WORKER_POOL_MAX) {
+		return krk_runtimeError(vm.exceptions->valueError, "pool size must be between 0 and %d", WORKER_POOL_MAX);
+	}
+	if (url->length >= sizeof(poolInfo.url)) {
+		return krk_runtimeError(vm.exceptions->valueError, "url is too long");
+	}
+	/* Workers for a different url are of no use any more */
+	int keep = strcmp(url->chars, poolInfo.url) ? 0 : size;
+	for (int i = poolInfo.count - 1; i >= 0 && poolInfo.count > keep; --i) {
+		if (workerPool[i].state == POOL_BUSY || workerPool[i].queued) pool_retire(workerPool[i].id);
+		else emscripten_destroy_worker(workerPool[i].id);
+		pool_remove(i);
+	}
+	memcpy(poolInfo.url, url->chars, url->length + 1);
+	poolInfo.size = size;
+	pool_fill();
+	return NONE_VAL();
+}
+
+#define POOL_STAT(name,value) krk_tableSet(AS_DICT(krk_peek(0)), OBJECT_VAL(S(name)), value)
+
+/**
+ * The pool's url, its counts, how many jobs have had to wait for a worker to warm up or
+ * start cold, and how long workers took from creation to being ready (ms).
+ */
+KRK_Function(worker_pool_stats) {
+	FUNCTION_TAKES_NONE();
+	int idle = 0, busy = 0, warming = 0, queued = 0;
+	for (int i = 0; i < poolInfo.count; ++i) {
+		switch (workerPool[i].state) {
+			case POOL_IDLE: idle++; break;
+			case POOL_BUSY: busy++; break;
+			case POOL_WARMING: warming++; queued += workerPool[i].queued; break;
+		}
+	}
+	krk_push(krk_dict_of(0,NULL,0));
+	POOL_STAT("url", OBJECT_VAL(krk_copyString(poolInfo.url, strlen(poolInfo.url))));
+	POOL_STAT("size", INTEGER_VAL(poolInfo.size));
+	POOL_STAT("idle", INTEGER_VAL(idle));
+	POOL_STAT("busy", INTEGER_VAL(busy));
+	POOL_STAT("warming", INTEGER_VAL(warming));
+	POOL_STAT("queued", INTEGER_VAL(queued));
+	POOL_STAT("cold_starts", INTEGER_VAL(poolInfo.coldStarts));
+	POOL_STAT("spawn_last", FLOATING_VAL(poolInfo.spawnLast));
+	POOL_STAT("spawn_mean", FLOATING_VAL(poolInfo.spawned ? poolInfo.spawnTotal / poolInfo.spawned : 0.0));
+	return krk_pop();
+}
+
+#undef POOL_STAT
+
 void init_jsModule(void) {
 
 	/* Set up module */
@@ -820,16 +2704,34 @@ void init_jsModule(void) {
 	krk_attachNamedObject(&jsModule->fields, "__name__", (KrkObj*)S("js"));
 	krk_attachNamedValue(&jsModule->fields, "__file__", NONE_VAL());
 
-	_objToId = krk_dict_of(0,NULL,0);
-	krk_attachNamedValue(&jsModule->fields, "__cache_objToId__", _objToId);
-	_objects = krk_dict_of(0,NULL,0);
-	krk_attachNamedValue(&jsModule->fields, "__cache_objects__", _objects);
+	KrkClass * ProxyTable = krk_newClass(S("ProxyTable"), vm.baseClasses->objectClass);
+	krk_push(OBJECT_VAL(ProxyTable));
+	ProxyTable->allocSize = sizeof(struct ProxyTable);
+	ProxyTable->_ongcscan = _proxytable_ongcscan;
+	ProxyTable->_ongcsweep = _proxytable_ongcsweep;
+	krk_finalizeClass(ProxyTable);
+	proxies = (struct ProxyTable*)krk_newInstance(ProxyTable);
+	krk_push(OBJECT_VAL(proxies));
+	krk_initTable(&proxies->ids);
+	krk_attachNamedObject(&jsModule->fields, "__proxies__", (KrkObj*)proxies);
+	krk_pop();
+	pins = (struct ProxyTable*)krk_newInstance(ProxyTable);
+	krk_push(OBJECT_VAL(pins));
+	krk_initTable(&pins->ids);
+	krk_attachNamedObject(&jsModule->fields, "__pins__", (KrkObj*)pins);
+	krk_pop();
+	krk_pop();
+	_strings = krk_list_of(0,NULL,0);
+	krk_attachNamedValue(&jsModule->fields, "__cache_strings__", _strings);
+	_stringIds = krk_dict_of(0,NULL,0);
+	krk_attachNamedValue(&jsModule->fields, "__cache_stringIds__", _stringIds);
 
 	js_krk_init();
 
 	krk_makeClass(jsModule, &JSObject, "JSObject", vm.baseClasses->objectClass);
 
 	JSObject->allocSize = sizeof(struct JSObject);
+	JSObject->_ongcscan = _jsobject_ongcscan;
 	JSObject->_ongcsweep = _jsobject_ongcsweep;
 
 	BIND_STATICMETHOD(JSObject,__new__);
@@ -840,9 +2742,37 @@ void init_jsModule(void) {
 	BIND_METHOD(JSObject,__call__);
 	BIND_METHOD(JSObject,__getitem__);
 	BIND_METHOD(JSObject,__dir__);
+	BIND_METHOD(JSObject,to_native);
+	BIND_METHOD(JSObject,to_bytes);
+	BIND_METHOD(JSObject,__len__);
+	BIND_METHOD(JSObject,__iter__);
 
 	krk_finalizeClass(JSObject);
 
+	krk_makeClass(jsModule, &JSIterator, "JSIterator", vm.baseClasses->objectClass);
+	JSIterator->allocSize = sizeof(struct JSIterator);
+	JSIterator->_ongcscan = _jsiterator_ongcscan;
+	JSIterator->_ongcsweep = _jsiterator_ongcsweep;
+	BIND_METHOD(JSIterator,__iter__);
+	BIND_METHOD(JSIterator,__call__);
+	krk_finalizeClass(JSIterator);
+
+	krk_makeClass(jsModule, &JSBatch, "JSBatch", vm.baseClasses->objectClass);
+	JSBatch->allocSize = sizeof(struct JSBatch);
+	JSBatch->_ongcscan = _jsbatch_ongcscan;
+	JSBatch->_ongcsweep = _jsbatch_ongcsweep;
+	BIND_METHOD(JSBatch,create);
+	BIND_METHOD(JSBatch,text);
+	BIND_METHOD(JSBatch,html);
+	BIND_METHOD(JSBatch,set);
+	BIND_METHOD(JSBatch,attr);
+	BIND_METHOD(JSBatch,append);
+	BIND_METHOD(JSBatch,flush);
+	BIND_METHOD(JSBatch,node);
+	BIND_METHOD(JSBatch,__enter__);
+	BIND_METHOD(JSBatch,__exit__);
+	krk_finalizeClass(JSBatch);
+
 #define ATTACH(thing) \
 	struct JSObject * _krk_ ## thing = (struct JSObject*)krk_newInstance(JSObject); \
 	krk_attachNamedObject(&jsModule->fields, # thing, (KrkObj*)_krk_ ## thing); \
@@ -859,6 +2789,14 @@ void init_jsModule(void) {
 	JsRef Js_window = hiwire_global("window");
 	ATTACH(window)
 
+	BIND_FUNC(jsModule,to_js);
+	BIND_FUNC(jsModule,to_kuroko);
+	BIND_FUNC(jsModule,view);
+	BIND_FUNC(jsModule,batch);
 	BIND_FUNC(jsModule,destroy_worker);
+	BIND_FUNC(jsModule,send_worker);
 	BIND_FUNC(jsModule,run_worker);
+	BIND_FUNC(jsModule,worker_run_stats);
+	BIND_FUNC(jsModule,worker_pool);
+	BIND_FUNC(jsModule,worker_pool_stats);
 }
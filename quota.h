@@ -0,0 +1,102 @@
+/**
+ * Per-run execution quotas, for both the page (wasmmain.c) and the worker
+ * (worker.c). Each runs code single-stepped through its debugger hook,
+ * which calls quota_step(). That counts instructions, and every
+ * QUOTA_CHECK_INTERVAL instructions compares the count, the time since
+ * the run started and how much the Kuroko heap has grown with the limits.
+ *
+ * A limit that is hit sets KRK_THREAD_SIGNALLED, which the VM raises as a
+ * KeyboardInterrupt; scripts can catch it, and the VM stays usable for the
+ * next run. It is raised again at every later check, so a script gets to
+ * clean up but not to carry on.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <emscripten.h>
+#include <kuroko/vm.h>
+
+#define QUOTA_CHECK_INTERVAL 1024
+
+struct Quota {
+	/* Limits, 0 for none */
+	uint64_t maxInstructions;
+	double maxMs;
+	size_t maxHeap;
+
+	/* Stats for the current or last run */
+	uint64_t instructions;
+	double startTime;
+	double elapsedMs;
+	size_t startHeap;
+	size_t heapGrowth;     /* Most the heap grew by at any check */
+	const char * exceeded; /* First limit that was hit */
+	int countdown;
+};
+
+/* Set the limits from JS numbers, where anything below 0 means no limit */
+static inline void quota_set(struct Quota * q, double instructions, double ms, double heap) {
+	q->maxInstructions = instructions > 0 ? instructions : 0;
+	q->maxMs = ms > 0 ? ms : 0;
+	q->maxHeap = heap > 0 ? heap : 0;
+}
+
+static inline int quota_active(struct Quota * q) {
+	return q->maxInstructions || q->maxMs > 0 || q->maxHeap;
+}
+
+static inline void quota_check(struct Quota * q) {
+	q->elapsedMs = emscripten_get_now() - q->startTime;
+	size_t growth = vm.bytesAllocated > q->startHeap ? vm.bytesAllocated - q->startHeap : 0;
+	if (growth > q->heapGrowth) q->heapGrowth = growth;
+
+	const char * exceeded = NULL;
+	if (q->maxInstructions && q->instructions > q->maxInstructions) exceeded = "instructions";
+	else if (q->maxMs > 0 && q->elapsedMs > q->maxMs) exceeded = "time";
+	else if (q->maxHeap && growth > q->maxHeap) exceeded = "memory";
+
+	if (exceeded) {
+		if (!q->exceeded) q->exceeded = exceeded;
+		krk_currentThread.flags |= KRK_THREAD_SIGNALLED;
+	}
+}
+
+static inline void quota_start(struct Quota * q) {
+	q->instructions = 0;
+	q->startTime = emscripten_get_now();
+	q->elapsedMs = 0;
+	q->startHeap = vm.bytesAllocated;
+	q->heapGrowth = 0;
+	q->exceeded = NULL;
+	q->countdown = QUOTA_CHECK_INTERVAL;
+}
+
+static inline void quota_step(struct Quota * q) {
+	q->instructions++;
+	if (--q->countdown > 0) return;
+	q->countdown = QUOTA_CHECK_INTERVAL;
+	quota_check(q);
+}
+
+/* Take the final stats, and drop a signal the VM didn't get to */
+static inline void quota_finish(struct Quota * q) {
+	q->elapsedMs = emscripten_get_now() - q->startTime;
+	size_t growth = vm.bytesAllocated > q->startHeap ? vm.bytesAllocated - q->startHeap : 0;
+	if (growth > q->heapGrowth) q->heapGrowth = growth;
+	krk_currentThread.flags &= ~(KRK_THREAD_SIGNALLED);
+}
+
+/* Stats as a JSON object, for the page's JavaScript */
+static inline void quota_stats(struct Quota * q, char * out, size_t size) {
+	snprintf(out, size, "{"
+		"\"instructions\": %llu,"
+		"\"ms\": %.3f,"
+		"\"heap_growth\": %lu,"
+		"\"exceeded\": %s%s%s"
+		"}",
+		(unsigned long long)q->instructions,
+		q->elapsedMs,
+		(unsigned long)q->heapGrowth,
+		q->exceeded ? "\"" : "", q->exceeded ? q->exceeded : "null", q->exceeded ? "\"" : "");
+}
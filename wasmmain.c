@@ -8,8 +8,11 @@
 #include <kuroko/kuroko.h>
 #include <kuroko/vm.h>
 #include <kuroko/memory.h>
+#include <kuroko/debug.h>
 #include <kuroko/util.h>
 
+#include "quota.h"
+
 /**
  * Copied over from the main interpreter; packages the C modules directly.
  * Emscripten has a dlopen() interface, but these modules should probably
@@ -23,20 +26,39 @@
 	krk_attachNamedValue(&AS_INSTANCE(moduleOut)->fields, "__file__", NONE_VAL()); \
 } while (0)
 
+/* Time slicing and quota hook, defined below with its state */
+static int step_hook(KrkCallFrame * frame);
+
 /**
- * This is built with NO_EXIT_RUNTIME, so when `main` returns none of the
- * normal exit routines are run and the VM stays "active" in the background.
+ * Everything here only touches linear memory, so with EVAL_CTORS the build
+ * runs it ahead of time and ships the resulting heap (see the Makefile).
+ * If it ever calls out to JS, the build leaves it to run at startup.
  */
-int main() {
+__attribute__((constructor))
+static void preinit(void) {
 	/* Set up VM with no flags */
 	vm.binpath = "/usr/local/bin/kuroko";
 	krk_initVM(0);
 
+	BUNDLED(math);
+
+	krk_debug_registerCallback(step_hook);
+
+	/* Set up the interpreter session */
+	krk_startModule("__main__");
+}
+
+/**
+ * This is built with NO_EXIT_RUNTIME, so when `main` returns none of the
+ * normal exit routines are run and the VM stays "active" in the background.
+ * What remains here has to happen at runtime: `random` seeds itself from
+ * the clock, and the js module binds Hiwire handles and JS objects.
+ */
+int main() {
 	/* If/when we do actually call exit, free the VM */
 	atexit(krk_freeVM);
 
 	/* Initialize the built-in C modules */
-	BUNDLED(math);
 	BUNDLED(random);
 
 	emscripten_run_script("Module.krkb = [];");
@@ -44,12 +66,92 @@ int main() {
 	extern void init_jsModule();
 	init_jsModule();
 
-	/* Set up the interpreter session */
-	krk_startModule("__main__");
-
 	return 0;
 }
 
+/**
+ * Time slicing. While krk_call runs with slicing on, the VM single-steps
+ * into step_hook, which checks the clock every `instructions` steps and,
+ * once `ms` have passed, sleeps to let the page handle events; the page
+ * build uses Asyncify, so krk_call picks up where it left off on a later
+ * task. The hook does nothing while a slice is suspended, in case JS calls
+ * back into Kuroko then. Messages from workers that would run Kuroko code
+ * wait until the run finishes instead (see js_run_deferred_later in js.c).
+ *
+ * Asyncify only instruments the path from krk_call down to this hook (see
+ * the Makefile), so it can't unwind through JS frames or through native
+ * functions that called back into the VM. The hook only yields from the
+ * outermost run of the VM, when exitOnFrame is still 0.
+ *
+ * Single-stepping costs on every instruction, so slicing is off until the
+ * page turns it on with setTimeSlice; benchmarkTimeSlicing in bench.js
+ * measures what it costs.
+ */
+extern int js_reentry;
+extern void js_run_deferred_later(void);
+
+static struct {
+	double ms;
+	int instructions;
+	int countdown;
+	int suspended;
+	double sliceStart;
+	int yields;       /* For the last krk_call */
+} slicing = { 0.0, 1000, 1000, 0, 0.0, 0 };
+
+/* Limits for each krk_call, see quota.h */
+static struct Quota quota;
+
+/* Whether a krk_call is suspended between slices; js.c holds worker messages then */
+int krk_slice_suspended(void) {
+	return slicing.suspended;
+}
+
+static int step_hook(KrkCallFrame * frame) {
+	if (slicing.suspended) return KRK_DEBUGGER_STEP;
+	quota_step(&quota);
+	if (slicing.ms <= 0 || js_reentry || krk_currentThread.exitOnFrame || --slicing.countdown > 0) return KRK_DEBUGGER_STEP;
+	slicing.countdown = slicing.instructions;
+	if (emscripten_get_now() - slicing.sliceStart >= slicing.ms) {
+		slicing.yields++;
+		slicing.suspended = 1;
+		emscripten_sleep(0);
+		slicing.suspended = 0;
+		slicing.sliceStart = emscripten_get_now();
+	}
+	return KRK_DEBUGGER_STEP;
+}
+
+/**
+ * Set how long krk_call runs before yielding and how many instructions go
+ * between checks of the clock. A time of 0 turns slicing off.
+ */
+EMSCRIPTEN_KEEPALIVE void krk_set_slice(double ms, int instructions) {
+	slicing.ms = ms;
+	slicing.instructions = instructions > 0 ? instructions : 1;
+}
+
+/* Number of times the last krk_call yielded */
+EMSCRIPTEN_KEEPALIVE int krk_slice_yields(void) {
+	return slicing.yields;
+}
+
+/**
+ * Limit each krk_call to a number of instructions, a time in milliseconds,
+ * and growth of the Kuroko heap in bytes; 0 (or less) leaves that one
+ * unlimited.
+ */
+EMSCRIPTEN_KEEPALIVE void krk_set_quota(double instructions, double ms, double heap) {
+	quota_set(&quota, instructions, ms, heap);
+}
+
+/* Stats for the last krk_call, as JSON */
+EMSCRIPTEN_KEEPALIVE const char * krk_run_stats(void) {
+	static char out[256];
+	quota_stats(&quota, out, sizeof(out));
+	return out;
+}
+
 /**
  * This is exposed to JavaScript and is how we implement the repl.
  * Compile and interpret an input. If the input is an expression,
@@ -59,7 +161,17 @@ int main() {
  */
 char * krk_call(char * src) {
 	krk_resetStack();
+	slicing.yields = 0;
+	slicing.countdown = slicing.instructions;
+	slicing.sliceStart = emscripten_get_now();
+	quota_start(&quota);
+	if (slicing.ms > 0 || quota_active(&quota)) {
+		krk_currentThread.flags |= KRK_THREAD_SINGLE_STEP;
+	}
 	KrkValue result = krk_interpret(src, "<stdin>");
+	krk_currentThread.flags &= ~(KRK_THREAD_SINGLE_STEP);
+	quota_finish(&quota);
+	js_run_deferred_later();
 	if (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION) {
 		krk_dumpTraceback();
 		krk_currentThread.flags &= ~(KRK_THREAD_HAS_EXCEPTION);
@@ -2,15 +2,23 @@
  * Kuroko WASM worker, runs like a normal interpreter?
  */
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <emscripten.h>
 #include <unistd.h>
 
 #include <kuroko/kuroko.h>
 #include <kuroko/vm.h>
+#include <kuroko/compiler.h>
 #include <kuroko/debug.h>
 #include <kuroko/util.h>
 
+/* For OP_BREAKPOINT, from the VM's source directory */
+#include "opcode_enum.h"
+
+#include "quota.h"
+
 /**
  * Copied over from the main interpreter; packages the C modules directly.
  * Emscripten has a dlopen() interface, but these modules should probably
@@ -26,19 +34,118 @@
 
 #define X(s) s,sizeof(s)-1
 
-EM_JS(int, check_status, (), {
-	return Module.awakeStatus;
-});
-
 EM_JS(void, reset_status, (), {
 	Module.awakeStatus = 0;
+	if (_control) Atomics.store(_control.i32, 0, 0);
+});
+
+/* With blocking waits, sleeps until the page responds; otherwise just checks */
+EM_JS(int, wait_status, (), {
+	return _waitForPage();
+});
+
+EM_JS(void, set_blocking_waits, (int blocking), {
+	if (_control) _control.blocking = !!blocking;
+});
+
+EM_JS(double, last_latency, (), {
+	return Module.lastLatency || -1;
+});
+
+/**
+ * Wait for the page to send a debugger command or an input line. Without
+ * shared memory this polls, unwinding the stack for each sleep.
+ */
+static int wait_for_page(void) {
+	int result;
+	while (!(result = wait_status())) {
+		emscripten_sleep(20);
+	}
+	return result;
+}
+
+/* Send buffered output ahead of a response that doesn't go through _craftMessage */
+EM_JS(void, flush_output, (), {
+	_flushOutput(true);
+});
+
+/* Send files the job changed, so the page has them when the result arrives */
+EM_JS(void, send_fs_changes, (), {
+	_fsSendChanges();
 });
 
+EM_JS(int, fs_persisting, (), {
+	return _fsChanges.persisting;
+});
+
+/**
+ * Send the job's file changes and wait until they are in IndexedDB, so
+ * they survive the page destroying the worker from its result callback.
+ */
+static void finish_fs_changes(void) {
+	send_fs_changes();
+	while (fs_persisting()) {
+		emscripten_sleep(5);
+	}
+}
+
 EM_JS(void, report_debugger, (const char *str), {
 	_craftMessage("d" + UTF8ToString(str));
 });
 
+EM_JS(void, report_stats, (const char *str), {
+	_craftMessage("q" + UTF8ToString(str));
+});
+
+/* Limits for each job, or each line in interactive mode; see quota.h */
+static struct Quota quota;
+
+/* Whether the debugger is stepping, as opposed to running for the quota */
+static int stepping = 0;
+
+/**
+ * Whether to run to the next breakpoint while a quota keeps us
+ * single-stepping: after the user asked to continue, or from the start
+ * of a job that wasn't started stepping.
+ */
+static int continuing = 0;
+
+/* Breakpoint just reported, in case the VM calls the hook again for it */
+static uint8_t * reportedBreakpoint = NULL;
+
+static void send_stats(void) {
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%llu %.3f %lu %s",
+		(unsigned long long)quota.instructions, quota.elapsedMs,
+		(unsigned long)quota.heapGrowth, quota.exceeded ? quota.exceeded : "-");
+	report_stats(tmp);
+}
+
+/**
+ * With a quota, code always runs single-stepped so this can count; the
+ * page only hears about steps while the debugger is stepping. After a
+ * 'continue' or a 'traceback', steps are skipped until the next
+ * instruction is a breakpoint. Breakpoints are reported whatever the last
+ * command was, as they would be without a quota.
+ */
 int worker_debugger_callback(KrkCallFrame * frame) {
+	if (quota_active(&quota)) {
+		quota_step(&quota);
+		if (frame->ip == reportedBreakpoint) {
+			/* The VM hands the breakpoint we stopped at to the hook again */
+			reportedBreakpoint = NULL;
+			return KRK_DEBUGGER_STEP;
+		}
+		reportedBreakpoint = NULL;
+		if (*frame->ip == OP_BREAKPOINT) {
+			/* Always reported, whatever the last command was */
+			continuing = 0;
+			reportedBreakpoint = frame->ip;
+		} else if (continuing || !stepping) {
+			return KRK_DEBUGGER_STEP;
+		}
+	}
+
 	reset_status();
 
 	char tmp[4096];
@@ -47,33 +154,43 @@ int worker_debugger_callback(KrkCallFrame * frame) {
 		"\"function\": \"%s\","
 		"\"file\": \"%s\","
 		"\"line\": %lu,"
-		"\"opcode\": %u"
+		"\"opcode\": %u,"
+		"\"latency\": %.3f"
 		"}",
 		(unsigned long)(frame->ip - frame->closure->function->chunk.code),
 		frame->closure->function->name->chars,
 		frame->closure->function->chunk.filename->chars,
 		(unsigned long)krk_lineNumber(&frame->closure->function->chunk,
 			(unsigned long)(frame->ip - frame->closure->function->chunk.code)),
-		(unsigned int)(*frame->ip));
+		(unsigned int)(*frame->ip),
+		last_latency());
 
 	report_debugger(tmp);
-	int result = 0;
-	do {
-		result = check_status();
-		if (result != 0) break;
-		emscripten_sleep(20);
-	} while (1);
+	int result = wait_for_page();
 
 	switch (result) {
 		case 1:
+			if (quota_active(&quota)) {
+				stepping = 0;
+				continuing = 1;
+				return KRK_DEBUGGER_STEP;
+			}
 			return KRK_DEBUGGER_CONTINUE;
 		case 2:
+			/* Single-stepping stays on; run on to the next breakpoint unless stepping */
+			if (!stepping) continuing = 1;
 			return KRK_DEBUGGER_RAISE;
 		case 3:
+			stepping = 1;
 			return KRK_DEBUGGER_STEP;
 		case 4:
 			return KRK_DEBUGGER_QUIT;
 		default:
+			if (quota_active(&quota)) {
+				stepping = 0;
+				continuing = 1;
+				return KRK_DEBUGGER_STEP;
+			}
 			return KRK_DEBUGGER_CONTINUE;
 	}
 }
@@ -92,13 +209,7 @@ EM_JS(char *, get_stdin_line, (void), {
 });
 
 static char * get_line(void) {
-	int result = 0;
-	do {
-		result = check_status();
-		if (result != 0) break;
-		emscripten_sleep(20);
-	} while (1);
-
+	wait_for_page();
 	return get_stdin_line();
 }
 
@@ -115,64 +226,220 @@ static KrkValue input(int argc, const KrkValue argv[], int hasKw) {
 	return OBJECT_VAL(krk_takeString(str,strlen(str)));
 }
 
+static int vm_ready = 0;
+static KrkValue compileCache;      /* source -> code object, see run_cached */
+static KrkValue compileCacheOrder; /* sources in the cache, oldest first */
+static KrkValue baseModules; /* vm.modules as init_vm left it */
+
+/**
+ * As in wasmmain.c, the parts of VM setup that only touch linear memory
+ * run as a constructor so EVAL_CTORS can do them at build time.
+ */
+__attribute__((constructor))
+static void preinit(void) {
+	/* Set up VM with no flags */
+	vm.binpath = "/usr/local/bin/kuroko";
+	krk_initVM(0);
+
+	BUNDLED(math);
+
+	krk_defineNative(&vm.builtins->fields, "input", input);
+	krk_debug_registerCallback(worker_debugger_callback);
+
+	KrkValue systemModule;
+	if (krk_tableGet(&vm.modules, OBJECT_VAL(krk_copyString("kuroko",6)), &systemModule)) {
+		compileCache = krk_dict_of(0,NULL,0);
+		krk_attachNamedValue(&AS_INSTANCE(systemModule)->fields, "__compile_cache__", compileCache);
+		compileCacheOrder = krk_list_of(0,NULL,0);
+		krk_attachNamedValue(&AS_INSTANCE(systemModule)->fields, "__compile_cache_order__", compileCacheOrder);
+	}
+}
+
+/* Finish setting up the VM once; later jobs reuse it */
+static void init_vm(void) {
+	if (vm_ready) return;
+
+	/* Seeds itself from the clock, so it can't be done ahead of time */
+	BUNDLED(random);
+
+	KrkValue systemModule;
+	if (krk_tableGet(&vm.modules, OBJECT_VAL(krk_copyString("kuroko",6)), &systemModule)) {
+		baseModules = krk_dict_of(0,NULL,0);
+		krk_attachNamedValue(&AS_INSTANCE(systemModule)->fields, "__base_modules__", baseModules);
+		krk_tableAddAll(&vm.modules, AS_DICT(baseModules));
+	}
+
+	vm_ready = 1;
+}
+
+/* Drop modules an earlier job imported, so each job imports its own */
+static void reset_modules(void) {
+	if (!IS_DICT(baseModules)) return;
+	krk_freeTable(&vm.modules);
+	krk_initTable(&vm.modules);
+	krk_tableAddAll(AS_DICT(baseModules), &vm.modules);
+}
+
+#define COMPILE_CACHE_MAX 64
+
+/**
+ * Run a script, reusing its code object if this VM has already compiled
+ * the same source. The cache is keyed by the source itself, so by its
+ * hash and then its contents, and a file edited in place is a new key. An
+ * entry only counts for the path it was compiled from, as that is baked
+ * into the code object. Kuroko has no serialized form for code objects,
+ * so the cache lives as long as the worker (many jobs, for pooled
+ * workers) and drops its oldest entry past COMPILE_CACHE_MAX sources.
+ *
+ * Only the job's own script goes through here. Modules it imports, from
+ * res/ or elsewhere, are loaded by the VM's importer, which compiles them
+ * from source; reset_modules drops them after each job, so they are
+ * compiled again by the next job that imports them.
+ */
+static KrkValue run_cached(char * fileName) {
+	FILE * f = fopen(fileName, "r");
+	if (!f || !IS_DICT(compileCache) || !IS_list(compileCacheOrder)) {
+		if (f) fclose(f);
+		return krk_runfile(fileName, fileName);
+	}
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char * buf = malloc(size + 1);
+	if (fread(buf, 1, size, f) != size) {
+		fclose(f);
+		free(buf);
+		return krk_runfile(fileName, fileName);
+	}
+	fclose(f);
+	buf[size] = '\0';
+
+	KrkString * source = krk_takeString(buf, size);
+	krk_push(OBJECT_VAL(source));
+	KrkString * path = krk_copyString(fileName, strlen(fileName));
+	krk_push(OBJECT_VAL(path));
+
+	KrkValue entry;
+	int known = krk_tableGet(AS_DICT(compileCache), OBJECT_VAL(source), &entry);
+	KrkCodeObject * code;
+	if (known && AS_codeobject(entry)->chunk.filename == path) {
+		code = AS_codeobject(entry);
+	} else {
+		code = krk_compile(source->chars, fileName);
+		if (!code) {
+			/* Report the SyntaxError as krk_runfile would have */
+			krk_dumpTraceback();
+			krk_currentThread.flags &= ~(KRK_THREAD_HAS_EXCEPTION);
+			krk_pop();
+			krk_pop();
+			return NONE_VAL();
+		}
+		krk_push(OBJECT_VAL(code));
+		krk_tableSet(AS_DICT(compileCache), OBJECT_VAL(source), OBJECT_VAL(code));
+		if (!known) {
+			KrkValueArray * order = AS_LIST(compileCacheOrder);
+			krk_writeValueArray(order, OBJECT_VAL(source));
+			if (order->count > COMPILE_CACHE_MAX) {
+				krk_tableDelete(AS_DICT(compileCache), order->values[0]);
+				memmove(order->values, order->values + 1, sizeof(KrkValue) * (order->count - 1));
+				order->count--;
+			}
+		}
+		krk_pop();
+	}
+
+	krk_attachNamedObject(&krk_currentThread.module->fields, "__file__", (KrkObj*)code->chunk.filename);
+	KrkClosure * closure = krk_newClosure(code, OBJECT_VAL(krk_currentThread.module));
+	krk_pop();
+	krk_pop();
+	krk_push(OBJECT_VAL(closure));
+	return krk_callStack(0);
+}
+
+/**
+ * Called by the page for workers kept in its pool: initialize the VM ahead
+ * of the first job and report back so the page can time it.
+ */
+void krk_warm_worker(char * data, int size) {
+	init_vm();
+	emscripten_worker_respond("w",1);
+}
+
 /**
  * This is built with NO_EXIT_RUNTIME, so when `main` returns none of the
  * normal exit routines are run and the VM stays "active" in the background.
+ * The VM is kept between jobs. Each job gets a fresh __main__ and the
+ * modules init_vm left loaded; anything an earlier job imported is loaded
+ * again. Those base modules (the bundled C modules and kuroko) are shared,
+ * so changes a job makes to them carry over to the next.
  */
 void krk_run_worker(char * data, int size) {
-	int flags = 0;
 	int interactive = 0;
 
+	init_vm();
+	reset_modules();
+	set_blocking_waits(0);
+
 	/* Retrieve cwd from caller */
 	chdir(data);
 	data += strlen(data) + 1;
 
 	/* Extract flags */
+	stepping = 0;
+	reportedBreakpoint = NULL;
 	while (*data) {
 		switch (*data) {
 			case 's':
-				flags |= KRK_THREAD_SINGLE_STEP;
+				stepping = 1;
 				break;
 			case 'i':
 				interactive = 1;
 				break;
+			case 'a':
+				set_blocking_waits(1);
+				break;
 		}
 		data++;
 	}
 
 	data++;
+	continuing = !stepping;
 
-	/* Set up VM with no flags */
-	vm.binpath = "/usr/local/bin/kuroko";
-	krk_initVM(flags);
+	/* Quota: instructions, milliseconds, heap bytes */
+	double maxInstructions = 0, maxMs = 0, maxHeap = 0;
+	sscanf(data, "%lf %lf %lf", &maxInstructions, &maxMs, &maxHeap);
+	quota_set(&quota, maxInstructions, maxMs, maxHeap);
+	data += strlen(data) + 1;
 
-	/* Initialize the built-in C modules */
-	BUNDLED(math);
-	BUNDLED(random);
+	if (stepping || quota_active(&quota)) {
+		krk_currentThread.flags |= KRK_THREAD_SINGLE_STEP;
+	}
 
 	/* Set up the interpreter session */
 	krk_startModule("__main__");
 	krk_attachNamedValue(&krk_currentThread.module->fields,"__doc__", NONE_VAL());
-	krk_defineNative(&vm.builtins->fields, "input", input);
-
-	krk_debug_registerCallback(worker_debugger_callback);
 
 	if (!interactive) {
-		KrkValue result = krk_runfile(data,data);
+		quota_start(&quota);
+		KrkValue result = run_cached(data);
+		quota_finish(&quota);
+		send_stats();
+		flush_output();
+		finish_fs_changes();
 
 		if (IS_STRING(result)) {
 			char * tmp = malloc(AS_STRING(result)->length + 2);
 			tmp[0] = 'x';
 			tmp[1] = 'S';
 			memcpy(tmp+2,AS_CSTRING(result),AS_STRING(result)->length);
-			emscripten_worker_respond_provisionally(tmp, AS_STRING(result)->length+2);
+			emscripten_worker_respond(tmp, AS_STRING(result)->length+2);
 			free(tmp);
 		} else if (IS_INTEGER(result)) {
 			char tmp[100];
 			sprintf(tmp, "xI%d", (int)AS_INTEGER(result));
-			emscripten_worker_respond_provisionally(tmp,strlen(tmp)+1);
+			emscripten_worker_respond(tmp,strlen(tmp)+1);
 		} else {
-			emscripten_worker_respond_provisionally("xN",2);
+			emscripten_worker_respond("xN",2);
 		}
 	} else {
 		KrkValue systemModule;
@@ -197,7 +464,11 @@ void krk_run_worker(char * data, int size) {
 			}
 
 			/* Run it... */
+			quota_start(&quota);
+			if (quota_active(&quota)) krk_currentThread.flags |= KRK_THREAD_SINGLE_STEP;
 			KrkValue result = krk_interpret(allData, "<stdin>");
+			quota_finish(&quota);
+			send_stats();
 			if (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION) {
 				krk_currentThread.flags &= ~(KRK_THREAD_HAS_EXCEPTION);
 			}
@@ -221,18 +492,12 @@ void krk_run_worker(char * data, int size) {
 			krk_resetStack();
 			free(allData);
 		}
-		emscripten_worker_respond_provisionally("xN",2);
+		flush_output();
+		finish_fs_changes();
+		emscripten_worker_respond("xN",2);
 	}
 
-	krk_freeVM();
-
-	EM_ASM(
-		if (_idbfsSuccess) {
-			FS.syncfs(function (err) {
-				console.log(err);
-				_craftMessage('F',true);
-			});
-		}
-	);
+	krk_resetStack();
+	krk_currentThread.flags &= ~(KRK_THREAD_HAS_EXCEPTION | KRK_THREAD_SINGLE_STEP);
 }
 
@@ -1,4 +1,4 @@
-function _craftMessage(data,finalResponse=false) {
+function _postMessage(data,finalResponse=false) {
   var buf = new Uint8Array(lengthBytesUTF8(data)+1);
   var actualNumBytes = stringToUTF8Array(data, buf, 0, buf.length);
   var transferObject = {
@@ -9,23 +9,203 @@ function _craftMessage(data,finalResponse=false) {
   postMessage(transferObject, [transferObject.data.buffer]);
 }
 
+function _craftMessage(data,finalResponse=false) {
+  /* Anything printed before this message has to arrive before it */
+  _flushOutput(true);
+  _postMessage(data,finalResponse);
+}
+
+/**
+ * When the page is cross-origin isolated it shares a control block with
+ * the worker (see worker_setup_shared in js.c). Keep the layout in sync:
+ *   int32 0: status for the debugger and input(), see messageCallback
+ *   int32 1: output bytes acknowledged by the page
+ *   int32 2: length of the input line
+ *   float64 at 16: when the page sent the last command
+ *   bytes from 24: the input line
+ * With the 'a' flag, the worker blocks on the status with Atomics.wait
+ * rather than polling for messages.
+ */
+var _control = null;
+
+function _now() {
+  return performance.timeOrigin + performance.now();
+}
+
+function _waitForPage() {
+  var status;
+  if (_control && _control.blocking) {
+    Atomics.wait(_control.i32, 0, 0);
+    status = Atomics.exchange(_control.i32, 0, 0);
+    if (waitingForInput) {
+      waitingForInput = 0;
+      Module.stdin_line = new TextDecoder().decode(_control.u8.slice(0, Atomics.load(_control.i32, 2)));
+    }
+    Module.sentAt = _control.f64[0];
+  } else {
+    status = Module.awakeStatus;
+  }
+  if (status && Module.sentAt) {
+    /* Round trip from the page sending a command to the worker resuming */
+    Module.lastLatency = _now() - Module.sentAt;
+    Module.sentAt = 0;
+  }
+  return status;
+}
+
+/**
+ * Output is sent to the page in chunks of lines rather than a message per
+ * line. Sizes are UTF-8 bytes throughout, as the page counts them. When
+ * cross-origin isolated, the page acknowledges the bytes it has written
+ * out through the control block, and with too much unacknowledged the
+ * worker waits for it. Without shared memory a busy worker never gets to
+ * read acknowledgements, so it sends at most OUTPUT_HIGH_WATER bytes in
+ * each OUTPUT_MAX_AGE ms instead. Output that would leave more than
+ * OUTPUT_MAX_PENDING bytes waiting is dropped, and a line saying how much
+ * was dropped takes its place.
+ */
+var OUTPUT_CHUNK = 16384;
+var OUTPUT_MAX_AGE = 50;
+var OUTPUT_HIGH_WATER = 1 << 20;
+var OUTPUT_MAX_PENDING = 8 << 20;
+
+var _output = {
+  queue: [],        /* Finished chunks, { text, bytes }, with their stream prefix */
+  queued: 0,        /* Bytes in the queue */
+  stream: '',       /* Stream of the chunk being built */
+  lines: [],
+  building: 0,      /* Bytes in lines */
+  since: 0,         /* When the oldest pending line was written */
+  sent: 0,          /* Bytes posted to the page */
+  windowStart: 0,   /* Without a control block: when the current window began */
+  windowSent: 0,    /* and bytes posted in it */
+  dropped: 0,       /* Bytes dropped since the last notice */
+  timer: 0,
+};
+
+function _outputWindowFull() {
+  if (_control) return ((_output.sent - Atomics.load(_control.i32, 1)) | 0) >= OUTPUT_HIGH_WATER;
+  var now = Date.now();
+  if (now - _output.windowStart >= OUTPUT_MAX_AGE) {
+    _output.windowStart = now;
+    _output.windowSent = 0;
+  }
+  return _output.windowSent >= OUTPUT_HIGH_WATER;
+}
+
+function _queueChunk(text) {
+  /* One byte for the terminator _postMessage adds */
+  var bytes = lengthBytesUTF8(text) + 1;
+  _output.queue.push({ text: text, bytes: bytes });
+  _output.queued += bytes;
+}
+
+function _finishChunk() {
+  if (!_output.lines.length) return;
+  _queueChunk(_output.stream + _output.lines.join('\n'));
+  _output.lines = [];
+  _output.building = 0;
+}
+
+/* Queue the notice for output dropped since the last one, in order */
+function _noteDropped() {
+  if (!_output.dropped) return;
+  _finishChunk();
+  _queueChunk('E[' + _output.dropped + ' bytes of output dropped]');
+  _output.dropped = 0;
+}
+
+function _flushOutput(force) {
+  if (_output.timer) {
+    clearTimeout(_output.timer);
+    _output.timer = 0;
+  }
+  if (force) _noteDropped();
+  _finishChunk();
+  while (_output.queue.length) {
+    if (!force && _outputWindowFull()) {
+      if (!_control) break;
+      Atomics.wait(_control.i32, 1, Atomics.load(_control.i32, 1), OUTPUT_MAX_AGE);
+      continue;
+    }
+    var chunk = _output.queue.shift();
+    _output.queued -= chunk.bytes;
+    _postMessage(chunk.text);
+    _output.sent += chunk.bytes;
+    _output.windowSent += chunk.bytes;
+  }
+  if (_output.queue.length) {
+    _output.timer = setTimeout(_flushOutput, OUTPUT_MAX_AGE);
+  }
+}
+
+function _writeOutput(stream, text) {
+  var bytes = lengthBytesUTF8(text) + 1;
+  var now = Date.now();
+  if (_output.queued + _output.building + bytes > OUTPUT_MAX_PENDING) {
+    _output.dropped += bytes;
+    /* Keep sending what is queued, so the notice gets its turn */
+    if (now - _output.since >= OUTPUT_MAX_AGE) {
+      _output.since = now;
+      _flushOutput(false);
+    }
+    return;
+  }
+  _noteDropped();
+  if (!_output.queued && !_output.building) _output.since = now;
+  if (stream !== _output.stream) {
+    _finishChunk();
+    _output.stream = stream;
+  }
+  _output.lines.push(text);
+  _output.building += bytes;
+  if (_output.building >= OUTPUT_CHUNK || now - _output.since >= OUTPUT_MAX_AGE) {
+    _flushOutput(false);
+  } else if (!_output.timer) {
+    _output.timer = setTimeout(_flushOutput, OUTPUT_MAX_AGE);
+  }
+}
+
 var waitingForInput = 0;
 
 function messageCallback(msg) {
-  if (typeof msg.data === 'string') {
+  if (msg.data && msg.data.fsChanges !== undefined) {
+    _fsApplyChanges(msg.data.fsChanges);
+    return false;
+  }
+  if (msg.data && msg.data.wasmModule !== undefined) {
+    _receiveWasmModule(msg.data.wasmModule);
+    return false;
+  }
+  if (msg.data && msg.data.control !== undefined) {
+    var buffer = msg.data.control;
+    _control = {
+      i32: new Int32Array(buffer, 0, 4),
+      f64: new Float64Array(buffer, 16, 1),
+      u8: new Uint8Array(buffer, 24),
+      blocking: false,
+    };
+    return false;
+  }
+  var data = msg.data;
+  if (data && data.command !== undefined) {
+    Module.sentAt = data.sentAt;
+    data = data.command;
+  }
+  if (typeof data === 'string') {
     if (waitingForInput) {
       waitingForInput = 0;
-      Module.stdin_line = msg.data;
+      Module.stdin_line = data;
       Module.awakeStatus = 1;
       return false;
     }
-    if (msg.data == 'continue') {
+    if (data == 'continue') {
       Module.awakeStatus = 1;
-    } else if (msg.data == 'traceback') {
+    } else if (data == 'traceback') {
       Module.awakeStatus = 2;
-    } else if (msg.data == 'step') {
+    } else if (data == 'step') {
       Module.awakeStatus = 3;
-    } else if (msg.data == 'quit') {
+    } else if (data == 'quit') {
       Module.awakeStatus = 4;
     }
     return false;
@@ -33,9 +213,185 @@ function messageCallback(msg) {
 }
 addEventListener("message",messageCallback);
 
+/**
+ * The library tree is listed in res/lib.json (see the Makefile), and each
+ * file is fetched with a synchronous request the first time it is read,
+ * so a worker only downloads the modules its program imports.
+ */
+function _loadLibraryTree() {
+  addRunDependency('lib.json');
+  fetch('/res/lib.json').then(function (response) {
+    return response.json();
+  }).then(function (manifest) {
+    for (const path in manifest) {
+      const split = path.lastIndexOf('/');
+      FS.mkdirTree(path.substring(0, split));
+      FS.createLazyFile(path.substring(0, split), path.substring(split + 1), '/' + manifest[path], true, false);
+    }
+  }).catch(function (err) {
+    _craftMessage('E(debug) Error loading library list.');
+  }).finally(function () {
+    removeRunDependency('lib.json');
+  });
+}
+
+/**
+ * Paths under the IDBFS mounts that a job has changed. When the job ends,
+ * the changed files go straight to the page (see worker_setup_fs in js.c),
+ * which also passes them on to its other workers. They are written to
+ * IndexedDB, for just those paths, and the job's final result waits for
+ * that (see finish_fs_changes in worker.c), so a worker destroyed as soon
+ * as its result arrives has already saved them.
+ */
+var FS_MOUNTS = ['/home/web_user', '/scratch'];
+
+var _fsChanges = {
+  tracking: false,     /* Off while IDBFS loads and while applying changes from the page */
+  dirty: new Set(),    /* Changed since the end of the last job */
+  persisting: 0,       /* IndexedDB transactions still open */
+};
+
+function _fsMount(path) {
+  for (var i = 0; i < FS_MOUNTS.length; ++i) {
+    if (path === FS_MOUNTS[i] || path.startsWith(FS_MOUNTS[i] + '/')) return FS_MOUNTS[i];
+  }
+  return null;
+}
+
+function _fsMark(path) {
+  if (!_fsChanges.tracking) return;
+  path = PATH_FS.resolve(path);
+  if (_fsMount(path)) _fsChanges.dirty.add(path);
+}
+
+/* Changing calls that take a path; anything opened for writing counts as changed */
+function _fsTrackChanges() {
+  function wrap(name, paths) {
+    var original = FS[name];
+    FS[name] = function () {
+      var result = original.apply(FS, arguments);
+      for (var i = 0; i < paths.length; ++i) _fsMark(arguments[paths[i]]);
+      return result;
+    };
+  }
+  wrap('mkdir', [0]);
+  wrap('rmdir', [0]);
+  wrap('unlink', [0]);
+  wrap('rename', [0, 1]);
+  wrap('symlink', [1]);
+  wrap('truncate', [0]);
+  var open = FS.open;
+  FS.open = function (path, flags) {
+    var stream = open.apply(FS, arguments);
+    if (stream.flags & 3) _fsMark(stream.path);
+    return stream;
+  };
+}
+
+/* Current state of each path; a directory brings everything under it */
+function _fsCollect(paths) {
+  var out = [];
+  var seen = new Set();
+  function visit(path) {
+    if (seen.has(path)) return;
+    seen.add(path);
+    var stat;
+    try {
+      stat = FS.stat(path);
+    } catch (err) {
+      out.push({ path: path, deleted: true });
+      return;
+    }
+    if (FS.isDir(stat.mode)) {
+      out.push({ path: path, dir: true, mode: stat.mode });
+      var names = FS.readdir(path);
+      for (var i = 0; i < names.length; ++i) {
+        if (names[i] !== '.' && names[i] !== '..') visit(path + '/' + names[i]);
+      }
+    } else if (FS.isFile(stat.mode)) {
+      out.push({ path: path, contents: FS.readFile(path).buffer, mode: stat.mode, timestamp: +stat.mtime });
+    }
+  }
+  paths.forEach(visit);
+  return out;
+}
+
+/* Called at the end of each job, before its result is sent */
+function _fsSendChanges() {
+  if (!_fsChanges.dirty.size) return;
+  var paths = _fsChanges.dirty;
+  var changes = _fsCollect(paths);
+  _fsChanges.dirty = new Set();
+  postMessage({ fsChanges: changes }, changes.filter(function (c) { return c.contents; }).map(function (c) { return c.contents; }));
+  _fsPersist(paths);
+}
+
+/* Write paths to IndexedDB; _fsChanges.persisting drops back to 0 when they are stored */
+function _fsPersist(paths) {
+  FS_MOUNTS.forEach(function (mount) {
+    var mine = [];
+    paths.forEach(function (path) { if (_fsMount(path) === mount) mine.push(path); });
+    if (!mine.length) return;
+    _fsChanges.persisting++;
+    IDBFS.getDB(mount, function (err, db) {
+      if (err) {
+        _fsChanges.persisting--;
+        return console.log(err);
+      }
+      var transaction = db.transaction([IDBFS.DB_STORE_NAME], 'readwrite');
+      /* A failed request aborts the transaction, so this runs once either way */
+      transaction.oncomplete = transaction.onabort = function () { _fsChanges.persisting--; };
+      var store = transaction.objectStore(IDBFS.DB_STORE_NAME);
+      var done = function (err) { if (err) console.log(err); };
+      _fsCollect(mine).forEach(function (change) {
+        if (change.deleted) {
+          store.delete(change.path);
+          store.delete(IDBKeyRange.bound(change.path + '/', change.path + '/\uffff'));
+        } else {
+          IDBFS.loadLocalEntry(change.path, function (err, entry) {
+            if (err) return done(err);
+            IDBFS.storeRemoteEntry(store, change.path, entry, done);
+          });
+        }
+      });
+    });
+  });
+}
+
+/* Changes another worker made, passed on by the page */
+function _fsApplyChanges(changes) {
+  _fsChanges.tracking = false;
+  try {
+    _fsApply(changes);
+  } finally {
+    _fsChanges.tracking = _idbfsSuccess;
+  }
+}
+
+/**
+ * The page sends the wasm module it compiled for this worker (see
+ * worker_post_module in js.c), so the worker only has to instantiate it.
+ * If the page has none to give, the worker compiles its own.
+ */
+var _receiveWasmModule;
+var _wasmModule = new Promise(function (resolve) { _receiveWasmModule = resolve; });
+
 var _idbfsSuccess = false;
 var Module = {
+  instantiateWasm: function(imports, receiveInstance) {
+    _wasmModule.then(function (module) {
+      return module || WebAssembly.compileStreaming(fetch(self.location.href.replace(/\.js$/, '.wasm')));
+    }).then(function (module) {
+      return WebAssembly.instantiate(module, imports).then(function (instance) {
+        receiveInstance(instance, module);
+      });
+    }).catch(function (err) {
+      _craftMessage('E(debug) Error loading interpreter.');
+    });
+    return {};
+  },
   preRun: [function() {
+    _loadLibraryTree();
     /* Load IDBFS */
     FS.mount(IDBFS, {}, '/home/web_user');
     FS.mkdir('/scratch');
@@ -45,46 +401,21 @@ var Module = {
         _craftMessage('E(debug) Error loading filesystem.');
       } else {
         _idbfsSuccess = true;
+        _fsChanges.tracking = true;
       }
     });
-    /* Create directories for runtime */
-    FS.mkdir('/usr');
-    FS.mkdir('/usr/local');
-    FS.mkdir('/usr/local/lib');
-    FS.mkdir('/usr/local/lib/kuroko');
-    FS.mkdir('/usr/local/lib/kuroko/syntax');
-    FS.mkdir('/usr/local/lib/kuroko/foo');
-    FS.mkdir('/usr/local/lib/kuroko/foo/bar');
-    /* Load source modules from web server */
-    const modules = ["help.krk","collections.krk","json.krk","string.krk","web.krk","dummy.krk","emscripten.krk"];
-    for (const i in modules) {
-      FS.createPreloadedFile('/usr/local/lib/kuroko', modules[i], "/res/" + modules[i], 1, 0)
-    }
-    FS.createPreloadedFile('/usr/local/lib/kuroko/syntax', '__init__.krk', '/res/init.krk', 1, 0)
-    FS.createPreloadedFile('/usr/local/lib/kuroko/syntax', 'highlighter.krk', '/res/highlighter.krk', 1, 0)
-    FS.createPreloadedFile('/usr/local/lib/kuroko/foo', '__init__.krk', '/res/init.krk', 1, 0)
-    FS.createPreloadedFile('/usr/local/lib/kuroko/foo/bar', '__init__.krk', '/res/init.krk', 1, 0)
-    FS.createPreloadedFile('/usr/local/lib/kuroko/foo/bar', 'baz.krk', '/res/baz.krk', 1, 0)
+    _fsTrackChanges();
     /* Go to home directory */
     FS.chdir('/home/web_user');
   }],
-  postRun: [function() {
-    if (_idbfsSuccess) {
-      FS.syncfs(function (err) {
-        if (err) {
-          console.log(err);
-        }
-      });
-    }
-  }],
 
   print: function(text) {
     if (arguments.length > 1) text = Array.prototype.slice.call(arguments).join(' ');
-    _craftMessage('O' + text);
+    _writeOutput('O', text);
   },
   printErr: function(text) {
     if (arguments.length > 1) text = Array.prototype.slice.call(arguments).join(' ');
-    _craftMessage('E' + text);
+    _writeOutput('E', text);
   }
 }
 